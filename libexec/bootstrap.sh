@@ -34,14 +34,31 @@ else
     exit 1
 fi
 
+# The bootstrap binary has parsed the definition already, load its dump
+# so get_key_from_conf and get_section_from_conf need not parse it again
+if [ -n "$SINGULARITY_DEF_DUMP_FD" ]; then
+    eval "`cat <&$SINGULARITY_DEF_DUMP_FD`"
+    eval "exec $SINGULARITY_DEF_DUMP_FD<&-"
+    unset SINGULARITY_DEF_DUMP_FD
+fi
+
 singularity_import linux_build
+if [ -n "$SINGULARITY_BUILD_CACHE" ]; then
+    singularity_import linux_build_cache
+fi
+if [ -n "$SINGULARITY_BUILD_OPTIMIZE" ]; then
+    singularity_import linux_build_optimize
+fi
+if [ -n "$SINGULARITY_BUILD_CACHE" -o -n "$SINGULARITY_BUILD_PROFILE" ]; then
+    BuildDirectives
+fi
 
 BUILD_SPEC="$1"
 shift
 
 # Always run these checks
 SanityCheck
-PreSetup
+BuildProfile PreSetup "-" "" PreSetup
 
 if [ -f "$BUILD_SPEC" ]; then
     # sourcing without a leading slash is weird and requires PATH
@@ -49,4 +66,19 @@ if [ -f "$BUILD_SPEC" ]; then
     . $BUILD_SPEC
 fi
 
-Finalize
+# Run what is still queued on its own, not as part of Finalize
+BuildFlush
+
+if [ -n "$SINGULARITY_BUILD_CACHE" ]; then
+    BuildProfile CacheRestore "-" "" BuildCacheFinish
+fi
+
+BuildProfile Finalize "-" "" Finalize
+
+if [ -n "$SINGULARITY_BUILD_OPTIMIZE" ]; then
+    Optimize
+fi
+
+if [ -n "$SINGULARITY_BUILD_REPRODUCIBLE" ]; then
+    BuildProfile Scrub "-" "" BuildScrub
+fi
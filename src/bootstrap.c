@@ -27,6 +27,9 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/param.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
 #include <errno.h> 
 #include <signal.h>
 #include <sched.h>
@@ -34,11 +37,16 @@
 #include <fcntl.h>  
 #include <grp.h>
 #include <libgen.h>
+#include <ftw.h>
+#include <time.h>
 
 #include "config.h"
 #include "mounts.h"
 #include "util.h"
 #include "loop-control.h"
+#include "image-util.h"
+#include "config-parser.h"
+#include "def-parser.h"
 
 
 #ifndef LIBEXECDIR
@@ -55,6 +63,27 @@
 // Yes, I know... Global variables suck but necessary to pass sig to child
 pid_t child_pid = 0;
 
+// Tally of the scratch build tree, nftw() gives no way to pass it in
+long long scratch_bytes = 0;
+long long scratch_entries = 0;
+
+// Reproducible builds stamp everything no later than SOURCE_DATE_EPOCH
+long long source_date_epoch = 0;
+
+// Build trace, bootstrap.sh adds a line per directive to the same file
+char *profile_path = NULL;
+
+struct profile_sample {
+    double wall;
+    double cpu;
+    long long used;
+};
+
+struct profile_entry {
+    char *line;
+    double wall;
+};
+
 
 void sighandler(int sig) {
     signal(sig, sighandler);
@@ -71,14 +100,243 @@ void sighandler(int sig) {
 }
 
 
+// Wall clock and CPU time of this process and its children so far, and the
+// space used by path: a file's allocation or a directory's file system
+static void profile_take(struct profile_sample *sample, char *path) {
+    struct timeval now;
+    struct rusage self;
+    struct rusage children;
+    struct statvfs fs;
+    struct stat filestat;
+
+    if ( profile_path == NULL ) {
+        return;
+    }
+
+    gettimeofday(&now, NULL);
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    sample->wall = now.tv_sec + now.tv_usec / 1000000.0;
+    sample->cpu = self.ru_utime.tv_sec + self.ru_stime.tv_sec + children.ru_utime.tv_sec + children.ru_stime.tv_sec +
+            ( self.ru_utime.tv_usec + self.ru_stime.tv_usec + children.ru_utime.tv_usec + children.ru_stime.tv_usec ) / 1000000.0;
+    sample->used = 0;
+
+    if ( path != NULL && stat(path, &filestat) == 0 ) {
+        if ( S_ISDIR(filestat.st_mode) && statvfs(path, &fs) == 0 ) {
+            sample->used = (long long)( fs.f_blocks - fs.f_bfree ) * fs.f_frsize;
+        } else if ( S_ISREG(filestat.st_mode) ) {
+            sample->used = (long long)filestat.st_blocks * 512;
+        }
+    }
+}
+
+
+static void profile_add(char *label, struct profile_sample *start, struct profile_sample *end) {
+    FILE *fp;
+
+    if ( profile_path == NULL ) {
+        return;
+    }
+
+    if ( ( fp = fopen(profile_path, "a") ) == NULL ) {
+        fprintf(stderr, "WARNING: Could not write build trace %s: %s\n", profile_path, strerror(errno));
+        return;
+    }
+    fprintf(fp, "%s\t-\t%.3f\t%.3f\t%lld\t\n", label, end->wall - start->wall, end->cpu - start->cpu, end->used - start->used);
+    fclose(fp);
+}
+
+
+static int profile_compare(const void *a, const void *b) {
+    const struct profile_entry *x = (const struct profile_entry *) a;
+    const struct profile_entry *y = (const struct profile_entry *) b;
+
+    return(( x->wall < y->wall ) - ( x->wall > y->wall ));
+}
+
+
+static void profile_print(char *line, double total) {
+    char *field[6] = { "", "", "0", "0", "0", "" };
+    char *tmp = line;
+    int f;
+
+    for ( f = 0; f < 6 && tmp != NULL; f++ ) {
+        field[f] = strsep(&tmp, "\t");
+    }
+
+    printf("%9.2fs %5.1f%% %9.2fs %10.1f  %-10.10s %s %.50s\n", atof(field[2]), ( total > 0 ) ? atof(field[2]) * 100 / total : 0,
+            atof(field[3]), atoll(field[4]) / 1024.0 / 1024.0, field[1], field[0], field[5]);
+}
+
+
+// Print every step in the trace, slowest first. The definition span takes
+// in every directive of the definition, so it is left out of the ranking
+// and printed as their total instead.
+static void profile_report(double total) {
+    struct profile_entry *entries = NULL;
+    char *definition = NULL;
+    char line[4096];
+    int count = 0;
+    int i;
+    FILE *fp;
+
+    if ( profile_path == NULL || ( fp = fopen(profile_path, "r") ) == NULL ) {
+        return;
+    }
+
+    while ( fgets(line, sizeof(line), fp) != NULL ) {
+        char *tab;
+        int field;
+
+        if ( line[0] == '#' ) {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        if ( strncmp(line, "bootstrap:definition\t", 21) == 0 ) {
+            free(definition);
+            definition = strdup(line);
+            continue;
+        }
+
+        entries = (struct profile_entry *) realloc(entries, sizeof(struct profile_entry) * ( count + 1 ));
+        entries[count].line = strdup(line);
+        entries[count].wall = 0;
+        for ( tab = line, field = 0; tab != NULL && field < 2; field++ ) {
+            if ( ( tab = strchr(tab, '\t') ) != NULL ) {
+                tab++;
+            }
+        }
+        if ( tab != NULL ) {
+            entries[count].wall = atof(tab);
+        }
+        count++;
+    }
+    fclose(fp);
+
+    qsort(entries, count, sizeof(struct profile_entry), profile_compare);
+
+    printf("\nBuild profile, slowest first (trace in %s):\n", profile_path);
+    printf("%10s %6s %10s %10s  %-10s %s\n", "WALL", "SHARE", "CPU", "MB", "LINES", "STEP");
+    for ( i = 0; i < count; i++ ) {
+        profile_print(entries[i].line, total);
+        free(entries[i].line);
+    }
+    free(entries);
+
+    if ( definition != NULL ) {
+        printf("%10s %6s %10s %10s\n", "----------", "------", "----------", "----------");
+        profile_print(definition, total);
+        free(definition);
+    }
+}
+
+
+static int scratch_tally(const char *path, const struct stat *filestat, int type, struct FTW *ftwbuf) {
+    scratch_entries++;
+    if ( S_ISREG(filestat->st_mode) || S_ISDIR(filestat->st_mode) || S_ISLNK(filestat->st_mode) ) {
+        scratch_bytes += ( filestat->st_size + 4095 ) / 4096 * 4096;
+    }
+    return(0);
+}
+
+
+// Clamping utimes() changes no parent directory's mtime, so the order of
+// the walk does not matter
+static int scratch_clamp(const char *path, const struct stat *filestat, int type, struct FTW *ftwbuf) {
+    struct timespec times[2];
+
+    times[0].tv_sec = source_date_epoch;
+    times[0].tv_nsec = 0;
+    times[1] = filestat->st_mtim;
+    if ( filestat->st_mtime >= source_date_epoch ) {
+        times[1] = times[0];
+    }
+
+    if ( utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) < 0 ) {
+        fprintf(stderr, "ERROR: Could not set times on %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+
+// Pack a finished scratch build into a new image sized for it in one pass
+// through mkfs, then put it in place of the container image
+static int scratch_pack(char *containerimage, char *buildroot) {
+    struct image_format_opts opts;
+    struct stat filestat;
+    char *newimage = strjoin(containerimage, ".new");
+    long long size;
+
+    if ( nftw(buildroot, scratch_tally, 64, FTW_PHYS | FTW_MOUNT) != 0 ) {
+        fprintf(stderr, "ERROR: Could not walk build root %s: %s\n", buildroot, strerror(errno));
+        return(-1);
+    }
+
+    opts.journal = ( getenv("SINGULARITY_IMAGE_JOURNAL") != NULL ) ? 1 : 0;
+    opts.inode_ratio = 8192;
+    opts.populate = buildroot;
+    opts.uuid = NULL;
+    opts.timestamp = 0;
+    size = image_size_for_content(scratch_bytes, scratch_entries, &opts);
+
+    // The UUID comes from the timestamp so that it is the same every time
+    if ( source_date_epoch > 0 ) {
+        if ( nftw(buildroot, scratch_clamp, 64, FTW_PHYS | FTW_MOUNT) != 0 ) {
+            fprintf(stderr, "ERROR: Could not clamp times in build root %s\n", buildroot);
+            return(-1);
+        }
+        opts.uuid = (char *) malloc(37);
+        snprintf(opts.uuid, 37, "00000000-0000-4000-8000-%012llx", source_date_epoch);
+        opts.timestamp = source_date_epoch;
+    }
+
+    printf("Packing %lld files into an image of %lldMB...\n", scratch_entries, size / 1024 / 1024);
+
+    if ( image_create(newimage, size, 0) < 0 || image_format(newimage, &opts) < 0 ) {
+        unlink(newimage);
+        return(-1);
+    }
+
+    // Keep the mode and owner of the image being replaced
+    if ( stat(containerimage, &filestat) == 0 ) {
+        if ( chmod(newimage, filestat.st_mode & 07777) < 0 || chown(newimage, filestat.st_uid, filestat.st_gid) < 0 ) {
+            fprintf(stderr, "WARNING: Could not copy permissions of %s\n", containerimage);
+        }
+    }
+
+    if ( rename(newimage, containerimage) < 0 ) {
+        fprintf(stderr, "ERROR: Could not replace %s: %s\n", containerimage, strerror(errno));
+        unlink(newimage);
+        return(-1);
+    }
+
+    free(newimage);
+
+    return(0);
+}
+
+
 int main(int argc, char ** argv) {
     char *containerimage;
     char *mountpoint;
     char *bootstrap_script;
     char *defintion_script;
     char *loop_dev;
+    char *scratch;
+    char *scratchdir = NULL;
+    char *config_path;
+    char *profile;
+    char dump_fd[16];
     int retval = 0;
     int containerimage_fd;
+    struct def_file def;
+    FILE *dump;
+    struct profile_sample build_start;
+    struct profile_sample start;
+    struct profile_sample end;
     uid_t uid = geteuid();
 
     if ( uid != 0 ) {
@@ -95,9 +353,71 @@ int main(int argc, char ** argv) {
     defintion_script = strdup(argv[2]);
     bootstrap_script = strjoin(LIBEXECDIR, "/singularity/bootstrap.sh");
 
+    config_path = joinpath(SYSCONFDIR, "/singularity/singularity.conf");
+    if ( is_file(config_path) == 0 ) {
+        if ( is_owner(config_path, 0) < 0 ) {
+            fprintf(stderr, "ABORT: Configuration file is not owned by root: %s\n", config_path);
+            return(255);
+        }
+        if ( config_open(config_path) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+    }
+
+    // The definition is parsed once, before anything is mounted, and handed
+    // to bootstrap.sh as an open dump for get_key_from_conf and
+    // get_section_from_conf
+    if ( is_file(defintion_script) == 0 ) {
+        if ( def_parse(defintion_script, &def) < 0 ) {
+            fprintf(stderr, "ABORT: Could not parse bootstrap definition: %s\n", defintion_script);
+            return(1);
+        }
+        if ( ( dump = tmpfile() ) == NULL ) {
+            fprintf(stderr, "ABORT: Could not create definition dump: %s\n", strerror(errno));
+            return(255);
+        }
+        if ( def_dump(&def, defintion_script, dump) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+        rewind(dump);
+        snprintf(dump_fd, sizeof(dump_fd), "%d", fileno(dump));
+        setenv("SINGULARITY_DEF_DUMP_FD", dump_fd, 1);
+    }
+
+    profile = mount_profile("bootstrap", "build");
+
     mountpoint = getenv("SINGULARITY_BUILD_ROOT");
+    scratch = getenv("SINGULARITY_BUILD_SCRATCH");
+    profile_path = getenv("SINGULARITY_BUILD_PROFILE");
+
+    // A reproducible image has to be packed from scratch, and without a
+    // given SOURCE_DATE_EPOCH it is dated by the definition
+    if ( getenv("SINGULARITY_BUILD_REPRODUCIBLE") != NULL ) {
+        char epoch[32];
+
+        if ( getenv("SOURCE_DATE_EPOCH") != NULL ) {
+            source_date_epoch = atoll(getenv("SOURCE_DATE_EPOCH"));
+        } else {
+            struct stat filestat;
+            if ( stat(defintion_script, &filestat) == 0 ) {
+                source_date_epoch = filestat.st_mtime;
+            }
+        }
+        if ( source_date_epoch <= 0 ) {
+            fprintf(stderr, "ABORT: Could not determine SOURCE_DATE_EPOCH for a reproducible build\n");
+            return(1);
+        }
+        snprintf(epoch, sizeof(epoch), "%lld", source_date_epoch);
+        setenv("SOURCE_DATE_EPOCH", epoch, 1);
+
+        if ( scratch == NULL ) {
+            scratch = ( getenv("TMPDIR") != NULL ) ? getenv("TMPDIR") : "/tmp";
+        }
+    }
 
-    if ( is_file(containerimage) < 0 ) {
+    if ( scratch == NULL && is_file(containerimage) < 0 ) {
         fprintf(stderr, "ABORT: Container image not found: %s\n", containerimage);
         return(1);
     }
@@ -117,23 +437,61 @@ int main(int argc, char ** argv) {
         return(255);
     }
 
+    if ( profile_path != NULL ) {
+        FILE *fp;
+        time_t now = time(NULL);
 
-    if ( ( containerimage_fd = open(containerimage, O_RDWR) ) < 0 ) {
-        fprintf(stderr, "ERROR: Could not open image %s: %s\n", containerimage, strerror(errno));
-        return(255);
+        if ( ( fp = fopen(profile_path, "w") ) == NULL ) {
+            fprintf(stderr, "ABORT: Could not create build trace %s: %s\n", profile_path, strerror(errno));
+            return(255);
+        }
+        fprintf(fp, "# Singularity bootstrap of %s from %s, %s", containerimage, defintion_script, ctime(&now));
+        fprintf(fp, "# step\tlines\twall seconds\tcpu seconds\tbytes added\targuments\n");
+        fclose(fp);
     }
 
-    loop_dev = obtain_loop_dev();
-    if ( associate_loop(containerimage_fd, loop_dev) < 0 ) {
-        fprintf(stderr, "ERROR: Could not associate %s to loop device %s\n", containerimage, loop_dev);
-        return(255);
-    }
+    profile_take(&build_start, NULL);
+    start = build_start;
 
-    if ( mount_image(loop_dev, mountpoint, 1) < 0 ) {
-        fprintf(stderr, "ABORT: exiting...\n");
-        return(255);
+    // Scratch builds run against a tmpfs or a local directory instead of
+    // the image on its loop device, and are packed into the image after
+    if ( scratch != NULL && strcmp(scratch, "tmpfs") == 0 ) {
+        if ( mount("tmpfs", mountpoint, "tmpfs", MS_NOSUID, "mode=0755") < 0 ) {
+            fprintf(stderr, "ABORT: Could not mount tmpfs on %s: %s\n", mountpoint, strerror(errno));
+            return(255);
+        }
+    } else if ( scratch != NULL ) {
+        scratchdir = joinpath(scratch, "singularity-build.XXXXXX");
+        if ( mkdtemp(scratchdir) == NULL || chmod(scratchdir, 0755) < 0 ) {
+            fprintf(stderr, "ABORT: Could not create build directory in %s: %s\n", scratch, strerror(errno));
+            return(255);
+        }
+        if ( mount(scratchdir, mountpoint, NULL, MS_BIND, NULL) < 0 ) {
+            fprintf(stderr, "ABORT: Could not bind %s to %s: %s\n", scratchdir, mountpoint, strerror(errno));
+            return(255);
+        }
+    } else {
+        if ( ( containerimage_fd = open(containerimage, O_RDWR) ) < 0 ) {
+            fprintf(stderr, "ERROR: Could not open image %s: %s\n", containerimage, strerror(errno));
+            return(255);
+        }
+
+        loop_dev = obtain_loop_dev();
+        if ( associate_loop(containerimage_fd, loop_dev, 0, 0) < 0 ) {
+            fprintf(stderr, "ERROR: Could not associate %s to loop device %s\n", containerimage, loop_dev);
+            return(255);
+        }
+
+        if ( mount_image(loop_dev, mountpoint, 1, profile) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
     }
 
+    profile_take(&end, NULL);
+    profile_add("bootstrap:setup", &start, &end);
+    profile_take(&start, mountpoint);
+
     child_pid = fork();
 
     if ( child_pid == 0 ) {
@@ -162,5 +520,36 @@ int main(int argc, char ** argv) {
         retval++;
     }
 
+    profile_take(&end, mountpoint);
+    profile_add("bootstrap:definition", &start, &end);
+
+    if ( scratch != NULL ) {
+        if ( retval == 0 ) {
+            profile_take(&start, containerimage);
+            if ( scratch_pack(containerimage, mountpoint) < 0 ) {
+                fprintf(stderr, "ERROR: Could not pack build into %s\n", containerimage);
+                retval = 255;
+            }
+            profile_take(&end, containerimage);
+            profile_add("bootstrap:pack", &start, &end);
+        }
+        if ( umount2(mountpoint, MNT_DETACH) < 0 ) {
+            fprintf(stderr, "WARNING: Could not unmount %s: %s\n", mountpoint, strerror(errno));
+        }
+        if ( scratchdir != NULL && s_rmdir(scratchdir) < 0 ) {
+            fprintf(stderr, "WARNING: Could not remove %s: %s\n", scratchdir, strerror(errno));
+        }
+    } else {
+        profile_take(&start, NULL);
+        mount_image_trim(mountpoint, profile);
+        profile_take(&end, NULL);
+        profile_add("bootstrap:trim", &start, &end);
+    }
+
+    if ( profile_path != NULL ) {
+        profile_take(&end, NULL);
+        profile_report(end.wall - build_start.wall);
+    }
+
     return(retval);
 }
@@ -0,0 +1,153 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <ctype.h>
+
+#include "config.h"
+#include "config-parser.h"
+#include "util.h"
+
+#define MAX_LINE_LEN 2048
+
+
+// The configuration is made of 'key = value' lines, '#' starts a comment.
+// A key may be given more than once, config_get_key_value() returns the
+// next one each time it is called. Without an open configuration file all
+// lookups return their defaults.
+static FILE *config_fp = NULL;
+
+
+static char *trim(char *string) {
+    char *end;
+
+    while ( isspace((unsigned char)*string) ) {
+        string++;
+    }
+
+    end = string + strlen(string);
+    while ( end > string && isspace((unsigned char)end[-1]) ) {
+        end--;
+    }
+    *end = '\0';
+
+    return(string);
+}
+
+
+int config_open(char *config_path) {
+    if ( ( config_fp = fopen(config_path, "r") ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not open configuration file %s: %s\n", config_path, strerror(errno));
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+void config_close(void) {
+    if ( config_fp != NULL ) {
+        fclose(config_fp);
+        config_fp = NULL;
+    }
+}
+
+
+void config_rewind(void) {
+    if ( config_fp != NULL ) {
+        rewind(config_fp);
+    }
+}
+
+
+char *config_get_key_value(char *key) {
+    char line[MAX_LINE_LEN];
+
+    if ( config_fp == NULL ) {
+        return(NULL);
+    }
+
+    while ( fgets(line, MAX_LINE_LEN, config_fp) != NULL ) {
+        char *comment = strchr(line, '#');
+        char *eq;
+
+        if ( comment != NULL ) {
+            *comment = '\0';
+        }
+
+        if ( ( eq = strchr(line, '=') ) == NULL ) {
+            continue;
+        }
+        *eq = '\0';
+
+        if ( strcmp(trim(line), key) == 0 ) {
+            return(strdup(trim(eq + 1)));
+        }
+    }
+
+    return(NULL);
+}
+
+
+int config_get_key_bool(char *key, int def) {
+    char *value;
+    int ret = def;
+
+    config_rewind();
+
+    if ( ( value = config_get_key_value(key) ) != NULL ) {
+        if ( strcmp(value, "yes") == 0 || strcmp(value, "1") == 0 || strcmp(value, "true") == 0 ) {
+            ret = 1;
+        } else if ( strcmp(value, "no") == 0 || strcmp(value, "0") == 0 || strcmp(value, "false") == 0 ) {
+            ret = 0;
+        } else {
+            fprintf(stderr, "WARNING: Unsupported value for configuration boolean '%s': %s\n", key, value);
+        }
+        free(value);
+    }
+
+    return(ret);
+}
+
+
+int config_get_key_int(char *key, int def) {
+    char *value;
+    char *end;
+    int ret = def;
+
+    config_rewind();
+
+    if ( ( value = config_get_key_value(key) ) != NULL ) {
+        ret = strtol(value, &end, 10);
+        if ( end == value || *end != '\0' ) {
+            fprintf(stderr, "WARNING: Unsupported value for configuration integer '%s': %s\n", key, value);
+            ret = def;
+        }
+        free(value);
+    }
+
+    return(ret);
+}
@@ -0,0 +1,52 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <ctype.h>
+
+#include "config.h"
+#include "def-parser.h"
+#include "util.h"
+
+
+int main(int argc, char ** argv) {
+    struct def_file def;
+
+    if ( argc != 2 ) {
+        fprintf(stderr, "USAGE: %s [definition file]\n", argv[0]);
+        return(1);
+    }
+
+    if ( def_parse(argv[1], &def) < 0 ) {
+        return(255);
+    }
+
+    if ( def_dump(&def, argv[1], stdout) < 0 ) {
+        return(255);
+    }
+
+    return(0);
+}
@@ -0,0 +1,247 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "config.h"
+#include "def-parser.h"
+#include "util.h"
+
+
+// A definition file has 'Key: value' lines and sections that each start
+// with a '%name' line and run to the next line starting with '%'. Like the
+// egrep based lookups this replaces, a key is any unindented 'Key:' line,
+// inside a section or not, key names are case insensitive and section names
+// are not. Comments and blank lines are dropped, a line ending in a backslash
+// continues on the next, and values are trimmed. Keys and sections that are
+// given twice keep their first value.
+
+
+static char *trim(char *string) {
+    char *end;
+
+    while ( isspace((unsigned char)*string) ) {
+        string++;
+    }
+
+    end = string + strlen(string);
+    while ( end > string && isspace((unsigned char)end[-1]) ) {
+        end--;
+    }
+    *end = '\0';
+
+    return(string);
+}
+
+
+static struct def_entry *def_find(struct def_entry *list, char *name, int nocase) {
+    for ( ; list != NULL; list = list->next ) {
+        if ( ( nocase ? strcasecmp(list->name, name) : strcmp(list->name, name) ) == 0 ) {
+            return(list);
+        }
+    }
+    return(NULL);
+}
+
+
+// Entries are appended so they keep the order of the file
+static struct def_entry *def_add(struct def_entry **list, char *name, char *value) {
+    struct def_entry *entry = (struct def_entry *) malloc(sizeof(struct def_entry));
+
+    entry->name = strdup(name);
+    entry->value = strdup(value);
+    entry->next = NULL;
+
+    while ( *list != NULL ) {
+        list = &(*list)->next;
+    }
+    *list = entry;
+
+    return(entry);
+}
+
+
+// Read one logical line, joining backslash continued physical lines
+static char *def_read_line(FILE *fp, char **buff, size_t *buff_size) {
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t ret;
+
+    while ( ( ret = getline(buff, buff_size, fp) ) >= 0 ) {
+        int more = 0;
+
+        if ( ret > 0 && (*buff)[ret - 1] == '\n' ) {
+            (*buff)[--ret] = '\0';
+        }
+        if ( ret > 0 && (*buff)[ret - 1] == '\\' ) {
+            (*buff)[--ret] = '\0';
+            more = 1;
+        }
+
+        line = (char *) realloc(line, len + ret + 1);
+        memcpy(line + len, *buff, ret + 1);
+        len += ret;
+
+        if ( more == 0 ) {
+            break;
+        }
+    }
+
+    return(line);
+}
+
+
+int def_parse(char *path, struct def_file *def) {
+    struct def_entry *section = NULL;
+    char *buff = NULL;
+    size_t buff_size = 0;
+    char *line;
+    FILE *fp;
+
+    def->keys = NULL;
+    def->sections = NULL;
+
+    if ( ( fp = fopen(path, "r") ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not open definition file %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+
+    while ( ( line = def_read_line(fp, &buff, &buff_size) ) != NULL ) {
+        char *colon = strchr(line, ':');
+        char *text;
+
+        // Keys are found before trimming, they have to start the line
+        if ( colon != NULL && colon != line && !isspace((unsigned char)line[0]) && line[0] != '#' && line[0] != '%' ) {
+            *colon = '\0';
+            if ( def_find(def->keys, line, 1) == NULL ) {
+                def_add(&def->keys, line, trim(colon + 1));
+            }
+            *colon = ':';
+        }
+
+        text = trim(line);
+
+        if ( text[0] == '%' ) {
+            char *name = trim(text + 1);
+
+            section = NULL;
+            if ( name[0] != '\0' && def_find(def->sections, name, 0) == NULL ) {
+                section = def_add(&def->sections, name, "");
+            }
+        } else if ( text[0] == '\0' || text[0] == '#' ) {
+            // Nothing to keep
+        } else if ( section != NULL ) {
+            size_t len = strlen(section->value);
+            section->value = (char *) realloc(section->value, len + strlen(text) + 2);
+            strcpy(section->value + len, text);
+            strcat(section->value + len, "\n");
+        }
+
+        free(line);
+    }
+
+    free(buff);
+    fclose(fp);
+
+    return(0);
+}
+
+
+char *def_get_key(struct def_file *def, char *key) {
+    struct def_entry *entry = def_find(def->keys, key, 1);
+
+    return(( entry != NULL ) ? entry->value : NULL);
+}
+
+
+char *def_get_section(struct def_file *def, char *section) {
+    struct def_entry *entry = def_find(def->sections, section, 0);
+
+    return(( entry != NULL ) ? entry->value : NULL);
+}
+
+
+// Single quote a value for the shell
+static void dump_quoted(FILE *out, char *value) {
+    fputc('\'', out);
+    for ( ; *value != '\0'; value++ ) {
+        if ( *value == '\'' ) {
+            fputs("'\\''", out);
+        } else {
+            fputc(*value, out);
+        }
+    }
+    fputc('\'', out);
+}
+
+
+// Anything that is not valid in a shell variable name is turned into '_',
+// key names are lower cased as they are looked up case insensitively
+static void dump_name(FILE *out, char *prefix, char *name, int lower) {
+    fputs(prefix, out);
+    for ( ; *name != '\0'; name++ ) {
+        if ( !isalnum((unsigned char)*name) ) {
+            fputc('_', out);
+        } else if ( lower ) {
+            fputc(tolower((unsigned char)*name), out);
+        } else {
+            fputc(*name, out);
+        }
+    }
+}
+
+
+// The whole definition as shell assignments, to be eval'ed in one go
+int def_dump(struct def_file *def, char *path, FILE *out) {
+    struct def_entry *entry;
+
+    fputs("SINGULARITY_DEF_FILE=", out);
+    dump_quoted(out, path);
+    fputc('\n', out);
+
+    for ( entry = def->keys; entry != NULL; entry = entry->next ) {
+        dump_name(out, "SINGULARITY_DEF_KEY_", entry->name, 1);
+        fputc('=', out);
+        dump_quoted(out, entry->value);
+        fputc('\n', out);
+    }
+
+    for ( entry = def->sections; entry != NULL; entry = entry->next ) {
+        dump_name(out, "SINGULARITY_DEF_SECTION_", entry->name, 0);
+        fputc('=', out);
+        dump_quoted(out, entry->value);
+        fputc('\n', out);
+    }
+
+    if ( fflush(out) != 0 || ferror(out) ) {
+        fprintf(stderr, "ERROR: Could not write definition dump: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    return(0);
+}
@@ -0,0 +1,36 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+
+struct def_entry {
+    char *name;
+    char *value;
+    struct def_entry *next;
+};
+
+struct def_file {
+    struct def_entry *keys;
+    struct def_entry *sections;
+};
+
+int def_parse(char *path, struct def_file *def);
+char *def_get_key(struct def_file *def, char *key);
+char *def_get_section(struct def_file *def, char *section);
+int def_dump(struct def_file *def, char *path, FILE *out);
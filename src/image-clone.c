@@ -0,0 +1,99 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "image-util.h"
+#include "util.h"
+
+
+int main(int argc, char ** argv) {
+    char *srcimage;
+    char *dstimage;
+    char *method;
+    struct stat filestat;
+    struct timeval start;
+    struct timeval end;
+    mode_t mode;
+    int src_fd;
+    int dst_fd;
+
+    if ( argc != 3 ) {
+        fprintf(stderr, "USAGE: %s [source image] [new image]\n", argv[0]);
+        return(1);
+    }
+
+    srcimage = strdup(argv[1]);
+    dstimage = strdup(argv[2]);
+
+    if ( is_file(srcimage) < 0 ) {
+        fprintf(stderr, "ABORT: Container image not found: %s\n", srcimage);
+        return(1);
+    }
+
+    if ( ( src_fd = open(srcimage, O_RDONLY) ) < 0 || fstat(src_fd, &filestat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", srcimage, strerror(errno));
+        return(255);
+    }
+
+    // Writable launches hold an exclusive lock, wait for a consistent image
+    if ( flock(src_fd, LOCK_SH | LOCK_NB) < 0 ) {
+        fprintf(stderr, "ABORT: Image is in use writable by another process: %s\n", srcimage);
+        return(5);
+    }
+
+    // Snapshots are read only point in time copies
+    mode = filestat.st_mode & 0777;
+    if ( getenv("SINGULARITY_IMAGE_SNAPSHOT") != NULL ) {
+        mode &= 0555;
+    }
+
+    if ( ( dst_fd = open(dstimage, O_CREAT | O_EXCL | O_WRONLY, 0600) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not create %s: %s\n", dstimage, strerror(errno));
+        return(255);
+    }
+
+    gettimeofday(&start, NULL);
+
+    if ( ( method = image_clone(src_fd, dst_fd, filestat.st_size) ) == NULL || fchmod(dst_fd, mode) < 0 || close(dst_fd) < 0 ) {
+        fprintf(stderr, "ABORT: Could not copy %s to %s\n", srcimage, dstimage);
+        unlink(dstimage);
+        return(255);
+    }
+
+    gettimeofday(&end, NULL);
+    close(src_fd);
+
+    printf("Copied %s to %s using %s (%lld bytes in %.2fs)\n", srcimage, dstimage, method, (long long)filestat.st_size,
+            ( end.tv_sec - start.tv_sec ) + ( end.tv_usec - start.tv_usec ) / 1000000.0);
+
+    return(0);
+}
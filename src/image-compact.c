@@ -0,0 +1,179 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <errno.h> 
+#include <sched.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "config.h"
+#include "image-util.h"
+#include "mounts.h"
+#include "util.h"
+#include "loop-control.h"
+#include "image-header.h"
+
+
+// Mount the image through a loop device and ask ext4 to discard its free
+// blocks. The loop driver turns those discards into FALLOC_FL_PUNCH_HOLE
+// on the backing image file.
+int image_trim(char *containerimage, int containerimage_fd) {
+    struct fstrim_range range;
+    char mountpoint[] = "/tmp/.singularity-compact.XXXXXX";
+    char *loop_dev;
+    int mountpoint_fd;
+
+    if ( unshare(CLONE_NEWNS) < 0 ) {
+        fprintf(stderr, "ERROR: Could not virtulize mount namespace\n");
+        return(-1);
+    }
+
+    if ( mount(NULL, "/", NULL, MS_PRIVATE|MS_REC, NULL) < 0 ) {
+        fprintf(stderr, "ERROR: Could not make mountspaces private: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    if ( mkdtemp(mountpoint) == NULL ) {
+        fprintf(stderr, "ERROR: Could not create temporary mount point: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    if ( ( loop_dev = obtain_loop_dev() ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not obtain a loop device\n");
+        rmdir(mountpoint);
+        return(-1);
+    }
+
+    if ( associate_loop(containerimage_fd, loop_dev, 0, 0) < 0 ) {
+        fprintf(stderr, "ERROR: Could not associate %s to loop device %s\n", containerimage, loop_dev);
+        rmdir(mountpoint);
+        return(-1);
+    }
+
+    if ( mount_image(loop_dev, mountpoint, 1, "default") < 0 ) {
+        rmdir(mountpoint);
+        return(-1);
+    }
+
+    if ( ( mountpoint_fd = open(mountpoint, O_RDONLY) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", mountpoint, strerror(errno));
+        umount(mountpoint);
+        rmdir(mountpoint);
+        return(-1);
+    }
+
+    range.start = 0;
+    range.len = ULLONG_MAX;
+    range.minlen = 0;
+
+    if ( ioctl(mountpoint_fd, FITRIM, &range) < 0 ) {
+        fprintf(stderr, "WARNING: Could not trim free blocks: %s\n", strerror(errno));
+    }
+
+    close(mountpoint_fd);
+
+    if ( umount(mountpoint) < 0 ) {
+        fprintf(stderr, "ERROR: Could not unmount %s: %s\n", mountpoint, strerror(errno));
+        return(-1);
+    }
+
+    rmdir(mountpoint);
+
+    return(0);
+}
+
+
+int main(int argc, char ** argv) {
+    char *containerimage;
+    int containerimage_fd;
+    struct image_header header;
+    long long before;
+    long long after;
+
+    if ( argv[1] == NULL ) {
+        fprintf(stderr, "USAGE: %s [singularity container image]\n", argv[0]);
+        return(1);
+    }
+
+    containerimage = strdup(argv[1]);
+
+    if ( is_file(containerimage) < 0 ) {
+        fprintf(stderr, "ABORT: Container image not found: %s\n", containerimage);
+        return(1);
+    }
+
+    if ( ( containerimage_fd = open(containerimage, O_RDWR) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", containerimage, strerror(errno));
+        return(255);
+    }
+
+    if ( image_header_read(containerimage_fd, &header, NULL, NULL) != 1 ) {
+        fprintf(stderr, "ABORT: Wrapped images can not be compacted, compact the raw image before wrapping it\n");
+        return(255);
+    }
+
+    if ( flock(containerimage_fd, LOCK_EX | LOCK_NB) < 0 ) {
+        fprintf(stderr, "ABORT: Image is in use by another process: %s\n", containerimage);
+        return(5);
+    }
+
+    before = image_allocated(containerimage_fd);
+
+    if ( getenv("SINGULARITY_IMAGE_SHRINK") != NULL ) {
+        if ( image_shrink(containerimage, containerimage_fd) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+    }
+
+    if ( geteuid() == 0 ) {
+        if ( image_trim(containerimage, containerimage_fd) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+    } else {
+        fprintf(stderr, "WARNING: Not root, free blocks that are not zero filled will be kept\n");
+    }
+
+    if ( image_punch_zeros(containerimage_fd) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        return(255);
+    }
+
+    after = image_allocated(containerimage_fd);
+
+    printf("Reclaimed %lld bytes (%lld -> %lld bytes allocated)\n", before - after, before, after);
+
+    close(containerimage_fd);
+
+    return(0);
+}
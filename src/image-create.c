@@ -0,0 +1,82 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+
+#include "config.h"
+#include "image-util.h"
+#include "util.h"
+
+
+int main(int argc, char ** argv) {
+    struct image_format_opts opts;
+    char *containerimage;
+    long long size;
+
+    if ( argv[1] == NULL || argv[2] == NULL ) {
+        fprintf(stderr, "USAGE: %s [singularity container image] [size in MB]\n", argv[0]);
+        return(1);
+    }
+
+    containerimage = strdup(argv[1]);
+    size = atoll(argv[2]) * 1024 * 1024;
+
+    if ( size <= 0 ) {
+        fprintf(stderr, "ABORT: Invalid image size: %s\n", argv[2]);
+        return(1);
+    }
+
+    opts.journal = 0;
+    opts.inode_ratio = 8192;
+    opts.inode_count = 0;
+    opts.populate = NULL;
+    opts.uuid = NULL;
+    opts.timestamp = 0;
+
+    if ( getenv("SINGULARITY_IMAGE_JOURNAL") != NULL ) {
+        opts.journal = 1;
+    }
+    if ( getenv("SINGULARITY_IMAGE_INODE_RATIO") != NULL ) {
+        opts.inode_ratio = atoi(getenv("SINGULARITY_IMAGE_INODE_RATIO"));
+        if ( opts.inode_ratio < 1024 ) {
+            fprintf(stderr, "ABORT: Inode ratio must be at least 1024 bytes\n");
+            return(1);
+        }
+    }
+
+    if ( image_create(containerimage, size, getenv("SINGULARITY_IMAGE_PREALLOCATE") != NULL) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        return(255);
+    }
+
+    if ( image_format(containerimage, &opts) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        return(255);
+    }
+
+    return(0);
+}
@@ -0,0 +1,51 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+
+// Delta files start with a header followed by a list of operations that
+// turn the old image into the new one. Any region not covered by an
+// operation is the same as the old image at that offset (or zero past the
+// end of the old image).
+
+#define DELTA_MAGIC "SINGDLT1"
+#define DELTA_CHUNK_SIZE (16 * 1024)
+
+#define DELTA_END 0
+#define DELTA_DATA 1
+#define DELTA_COPY 2
+#define DELTA_ZERO 3
+
+struct delta_header {
+    char magic[8];
+    uint32_t chunk_size;
+    uint32_t reserved;
+    uint64_t old_size;
+    uint64_t new_size;
+    unsigned char old_root[32];
+    unsigned char new_root[32];
+};
+
+struct delta_op {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t source;
+};
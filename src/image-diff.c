@@ -0,0 +1,326 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "image-delta.h"
+#include "image-digest.h"
+#include "sha256.h"
+#include "util.h"
+
+
+struct chunk_index {
+    uint64_t *hashes;
+    int64_t *offsets;
+    uint64_t mask;
+};
+
+
+static uint64_t chunk_hash(unsigned char *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t word;
+    size_t i;
+
+    for ( i = 0; i + 8 <= len; i += 8 ) {
+        memcpy(&word, data + i, 8);
+        hash = ( hash ^ word ) * 1099511628211ULL;
+    }
+    for ( ; i < len; i++ ) {
+        hash = ( hash ^ data[i] ) * 1099511628211ULL;
+    }
+
+    return(hash);
+}
+
+
+static int chunk_is_zero(unsigned char *data, size_t len) {
+    static unsigned char zero[DELTA_CHUNK_SIZE];
+
+    return(memcmp(data, zero, len) == 0);
+}
+
+
+// Returns 1 if the chunk at offset lies entirely within a hole
+static int chunk_is_hole(int fd, off_t offset, size_t len) {
+    off_t data = lseek(fd, offset, SEEK_DATA);
+
+    if ( data < 0 && errno == ENXIO ) {
+        return(1);
+    }
+
+    return(data >= offset + (off_t)len);
+}
+
+
+static ssize_t chunk_read(int fd, unsigned char *buff, size_t len, off_t offset) {
+    size_t pos = 0;
+
+    while ( pos < len ) {
+        ssize_t ret = pread(fd, buff + pos, len - pos, offset + pos);
+        if ( ret <= 0 ) {
+            return(-1);
+        }
+        pos += ret;
+    }
+
+    return(pos);
+}
+
+
+// Index every non-zero chunk of the old image by a fast hash so chunks that
+// moved to a different offset in the new image can be found again
+static int index_build(struct chunk_index *index, int old_fd, long long old_size) {
+    unsigned char buff[DELTA_CHUNK_SIZE];
+    long long chunks = old_size / DELTA_CHUNK_SIZE;
+    uint64_t slots = 1024;
+    long long i;
+
+    while ( slots < (uint64_t)chunks * 2 ) {
+        slots <<= 1;
+    }
+
+    index->mask = slots - 1;
+    index->hashes = (uint64_t *) calloc(slots, sizeof(uint64_t));
+    index->offsets = (int64_t *) malloc(slots * sizeof(int64_t));
+    if ( index->hashes == NULL || index->offsets == NULL ) {
+        fprintf(stderr, "ERROR: Could not allocate memory for chunk index\n");
+        return(-1);
+    }
+    memset(index->offsets, 0xff, slots * sizeof(int64_t));
+
+    for ( i = 0; i < chunks; i++ ) {
+        off_t offset = i * DELTA_CHUNK_SIZE;
+        uint64_t hash;
+        uint64_t slot;
+
+        if ( chunk_is_hole(old_fd, offset, DELTA_CHUNK_SIZE) ) {
+            continue;
+        }
+        if ( chunk_read(old_fd, buff, DELTA_CHUNK_SIZE, offset) < 0 ) {
+            fprintf(stderr, "ERROR: Could not read old image: %s\n", strerror(errno));
+            return(-1);
+        }
+        if ( chunk_is_zero(buff, DELTA_CHUNK_SIZE) ) {
+            continue;
+        }
+
+        hash = chunk_hash(buff, DELTA_CHUNK_SIZE);
+        for ( slot = hash & index->mask; index->offsets[slot] >= 0; slot = ( slot + 1 ) & index->mask ) {
+            if ( index->hashes[slot] == hash ) {
+                break;
+            }
+        }
+        if ( index->offsets[slot] < 0 ) {
+            index->hashes[slot] = hash;
+            index->offsets[slot] = offset;
+        }
+    }
+
+    return(0);
+}
+
+
+static off_t index_lookup(struct chunk_index *index, int old_fd, unsigned char *data) {
+    unsigned char buff[DELTA_CHUNK_SIZE];
+    uint64_t hash = chunk_hash(data, DELTA_CHUNK_SIZE);
+    uint64_t slot;
+
+    for ( slot = hash & index->mask; index->offsets[slot] >= 0; slot = ( slot + 1 ) & index->mask ) {
+        if ( index->hashes[slot] == hash ) {
+            // Confirm the match, the hash is only a hint
+            if ( chunk_read(old_fd, buff, DELTA_CHUNK_SIZE, index->offsets[slot]) > 0 && memcmp(buff, data, DELTA_CHUNK_SIZE) == 0 ) {
+                return(index->offsets[slot]);
+            }
+            return(-1);
+        }
+    }
+
+    return(-1);
+}
+
+
+static int op_write(FILE *delta, struct delta_op *op, unsigned char *data) {
+    if ( fwrite(op, sizeof(struct delta_op), 1, delta) != 1 ) {
+        return(-1);
+    }
+    if ( data != NULL && fwrite(data, op->length, 1, delta) != 1 ) {
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+// Copy and zero operations over adjacent chunks are merged before writing
+static int op_emit(FILE *delta, struct delta_op *pending, uint32_t type, uint64_t offset, uint64_t length, uint64_t source, unsigned char *data) {
+    if ( pending->type == type && type != DELTA_DATA && pending->offset + pending->length == offset && ( type != DELTA_COPY || pending->source + pending->length == source ) ) {
+        pending->length += length;
+        return(0);
+    }
+
+    if ( pending->type != DELTA_END && op_write(delta, pending, NULL) < 0 ) {
+        return(-1);
+    }
+
+    pending->type = type;
+    pending->offset = offset;
+    pending->length = length;
+    pending->source = source;
+
+    if ( type == DELTA_DATA ) {
+        if ( op_write(delta, pending, data) < 0 ) {
+            return(-1);
+        }
+        pending->type = DELTA_END;
+    }
+
+    return(0);
+}
+
+
+int main(int argc, char ** argv) {
+    struct delta_header header;
+    struct delta_op pending;
+    struct delta_op end;
+    struct chunk_index index;
+    struct stat old_stat;
+    struct stat new_stat;
+    unsigned char new_buff[DELTA_CHUNK_SIZE];
+    unsigned char old_buff[DELTA_CHUNK_SIZE];
+    long long offset;
+    long long data_bytes = 0;
+    FILE *delta;
+    int old_fd;
+    int new_fd;
+
+    if ( argv[1] == NULL || argv[2] == NULL || argv[3] == NULL ) {
+        fprintf(stderr, "USAGE: %s [old image] [new image] [delta file]\n", argv[0]);
+        return(1);
+    }
+
+    if ( ( old_fd = open(argv[1], O_RDONLY) ) < 0 || fstat(old_fd, &old_stat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", argv[1], strerror(errno));
+        return(255);
+    }
+    if ( ( new_fd = open(argv[2], O_RDONLY) ) < 0 || fstat(new_fd, &new_stat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", argv[2], strerror(errno));
+        return(255);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+    header.chunk_size = DELTA_CHUNK_SIZE;
+    header.old_size = old_stat.st_size;
+    header.new_size = new_stat.st_size;
+
+    // The roots tie the delta to exactly one base image and let patch
+    // confirm its result
+    if ( image_digest(old_fd, 0, old_stat.st_size, header.old_root) < 0 || image_digest(new_fd, 0, new_stat.st_size, header.new_root) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        return(255);
+    }
+
+    if ( index_build(&index, old_fd, old_stat.st_size) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        return(255);
+    }
+
+    if ( ( delta = fopen(argv[3], "w") ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not write delta %s: %s\n", argv[3], strerror(errno));
+        return(255);
+    }
+
+    if ( fwrite(&header, sizeof(header), 1, delta) != 1 ) {
+        fprintf(stderr, "ERROR: Could not write delta %s: %s\n", argv[3], strerror(errno));
+        return(255);
+    }
+
+    memset(&pending, 0, sizeof(pending));
+    pending.type = DELTA_END;
+
+    for ( offset = 0; offset < new_stat.st_size; offset += DELTA_CHUNK_SIZE ) {
+        size_t len = ( new_stat.st_size - offset ) < DELTA_CHUNK_SIZE ? ( new_stat.st_size - offset ) : DELTA_CHUNK_SIZE;
+        int in_old = ( offset + (long long)len <= old_stat.st_size );
+        int new_zero;
+        int old_zero = 1;
+        off_t source;
+        int retval;
+
+        new_zero = chunk_is_hole(new_fd, offset, len);
+        if ( ! new_zero ) {
+            if ( chunk_read(new_fd, new_buff, len, offset) < 0 ) {
+                fprintf(stderr, "ERROR: Could not read new image: %s\n", strerror(errno));
+                return(255);
+            }
+            new_zero = chunk_is_zero(new_buff, len);
+        }
+
+        if ( offset < old_stat.st_size ) {
+            size_t old_len = ( old_stat.st_size - offset ) < (long long)len ? ( old_stat.st_size - offset ) : len;
+            if ( ! chunk_is_hole(old_fd, offset, old_len) ) {
+                if ( chunk_read(old_fd, old_buff, old_len, offset) < 0 ) {
+                    fprintf(stderr, "ERROR: Could not read old image: %s\n", strerror(errno));
+                    return(255);
+                }
+                old_zero = chunk_is_zero(old_buff, old_len);
+            }
+        }
+
+        if ( new_zero ) {
+            if ( old_zero ) {
+                continue;
+            }
+            retval = op_emit(delta, &pending, DELTA_ZERO, offset, len, 0, NULL);
+        } else if ( in_old && ! old_zero && memcmp(new_buff, old_buff, len) == 0 ) {
+            continue;
+        } else if ( len == DELTA_CHUNK_SIZE && ( source = index_lookup(&index, old_fd, new_buff) ) >= 0 ) {
+            retval = op_emit(delta, &pending, DELTA_COPY, offset, len, source, NULL);
+        } else {
+            retval = op_emit(delta, &pending, DELTA_DATA, offset, len, 0, new_buff);
+            data_bytes += len;
+        }
+
+        if ( retval < 0 ) {
+            fprintf(stderr, "ERROR: Could not write delta %s: %s\n", argv[3], strerror(errno));
+            return(255);
+        }
+    }
+
+    memset(&end, 0, sizeof(end));
+    end.type = DELTA_END;
+    if ( ( pending.type != DELTA_END && op_write(delta, &pending, NULL) < 0 ) || fwrite(&end, sizeof(end), 1, delta) != 1 || fclose(delta) != 0 ) {
+        fprintf(stderr, "ERROR: Could not write delta %s: %s\n", argv[3], strerror(errno));
+        return(255);
+    }
+
+    printf("Delta carries %lld bytes of new data for a %lld byte image\n", data_bytes, (long long)new_stat.st_size);
+
+    return(0);
+}
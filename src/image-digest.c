@@ -0,0 +1,340 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "image-digest.h"
+#include "sha256.h"
+#include "util.h"
+
+
+struct digest_job {
+    int fd;
+    long long offset;
+    long long length;
+    long long chunks;
+    long long next;
+    int error;
+    pthread_mutex_t lock;
+    unsigned char *leaves;
+    unsigned char zero_leaf[SHA256_DIGEST_LENGTH];
+};
+
+
+static void digest_leaf(unsigned char *data, size_t len, unsigned char *hash) {
+    struct sha256_ctx ctx;
+    unsigned char prefix = 0x00;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, hash);
+}
+
+
+static void digest_node(unsigned char *left, unsigned char *right, unsigned char *hash) {
+    struct sha256_ctx ctx;
+    unsigned char prefix = 0x01;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, &prefix, 1);
+    sha256_update(&ctx, left, SHA256_DIGEST_LENGTH);
+    sha256_update(&ctx, right, SHA256_DIGEST_LENGTH);
+    sha256_final(&ctx, hash);
+}
+
+
+static void *digest_worker(void *arg) {
+    struct digest_job *job = (struct digest_job *) arg;
+    unsigned char *buff;
+
+    if ( ( buff = (unsigned char *) malloc(DIGEST_CHUNK_SIZE) ) == NULL ) {
+        job->error = ENOMEM;
+        return(NULL);
+    }
+
+    while ( 1 ) {
+        long long chunk;
+        long long start;
+        long long len;
+        long long pos;
+        off_t data;
+
+        pthread_mutex_lock(&job->lock);
+        chunk = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if ( chunk >= job->chunks || job->error != 0 ) {
+            break;
+        }
+
+        start = job->offset + chunk * DIGEST_CHUNK_SIZE;
+        len = job->length - chunk * DIGEST_CHUNK_SIZE;
+        if ( len > DIGEST_CHUNK_SIZE ) {
+            len = DIGEST_CHUNK_SIZE;
+        }
+
+        // Chunks that are entirely a hole hash to a known value
+        data = lseek(job->fd, start, SEEK_DATA);
+        if ( len == DIGEST_CHUNK_SIZE && ( ( data < 0 && errno == ENXIO ) || data >= start + len ) ) {
+            memcpy(job->leaves + chunk * SHA256_DIGEST_LENGTH, job->zero_leaf, SHA256_DIGEST_LENGTH);
+            continue;
+        }
+
+        for ( pos = 0; pos < len; ) {
+            ssize_t ret = pread(job->fd, buff + pos, len - pos, start + pos);
+            if ( ret <= 0 ) {
+                job->error = ( ret < 0 ) ? errno : EIO;
+                break;
+            }
+            pos += ret;
+        }
+
+        digest_leaf(buff, len, job->leaves + chunk * SHA256_DIGEST_LENGTH);
+    }
+
+    free(buff);
+
+    return(NULL);
+}
+
+
+// Hash fixed size chunks of the image in parallel and fold the chunk
+// hashes into a binary Merkle tree. Odd nodes are carried up a level.
+int image_digest(int image_fd, long long offset, long long length, unsigned char *root) {
+    struct digest_job job;
+    pthread_t threads[DIGEST_MAX_THREADS];
+    unsigned char *zero;
+    long long count;
+    long nthreads;
+    long i;
+    int retval;
+
+    job.fd = image_fd;
+    job.offset = offset;
+    job.length = length;
+    job.chunks = ( length + DIGEST_CHUNK_SIZE - 1 ) / DIGEST_CHUNK_SIZE;
+    job.next = 0;
+    job.error = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    if ( job.chunks == 0 ) {
+        digest_leaf(NULL, 0, root);
+        return(0);
+    }
+
+    job.leaves = (unsigned char *) malloc(job.chunks * SHA256_DIGEST_LENGTH);
+    zero = (unsigned char *) calloc(1, DIGEST_CHUNK_SIZE);
+    if ( job.leaves == NULL || zero == NULL ) {
+        fprintf(stderr, "ERROR: Could not allocate memory for image digest\n");
+        return(-1);
+    }
+    digest_leaf(zero, DIGEST_CHUNK_SIZE, job.zero_leaf);
+    free(zero);
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if ( nthreads < 1 ) {
+        nthreads = 1;
+    } else if ( nthreads > DIGEST_MAX_THREADS ) {
+        nthreads = DIGEST_MAX_THREADS;
+    }
+    if ( nthreads > job.chunks ) {
+        nthreads = job.chunks;
+    }
+
+    // The calling thread works through chunks too, so if threads can not be
+    // created (e.g. in a new PID namespace) the digest is still computed
+    for ( i = 0; i < nthreads - 1; i++ ) {
+        if ( ( retval = pthread_create(&threads[i], NULL, digest_worker, &job) ) != 0 ) {
+            fprintf(stderr, "WARNING: Hashing the image with %ld of %ld threads: %s\n", i + 1, nthreads, strerror(retval));
+            break;
+        }
+    }
+    nthreads = i;
+
+    digest_worker(&job);
+
+    for ( i = 0; i < nthreads; i++ ) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+
+    if ( job.error != 0 ) {
+        fprintf(stderr, "ERROR: Could not read image for digest: %s\n", strerror(job.error));
+        free(job.leaves);
+        return(-1);
+    }
+
+    for ( count = job.chunks; count > 1; count = ( count + 1 ) / 2 ) {
+        for ( i = 0; i < count / 2; i++ ) {
+            digest_node(job.leaves + ( i * 2 ) * SHA256_DIGEST_LENGTH, job.leaves + ( i * 2 + 1 ) * SHA256_DIGEST_LENGTH, job.leaves + i * SHA256_DIGEST_LENGTH);
+        }
+        if ( count % 2 ) {
+            memmove(job.leaves + ( count / 2 ) * SHA256_DIGEST_LENGTH, job.leaves + ( count - 1 ) * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+        }
+    }
+
+    memcpy(root, job.leaves, SHA256_DIGEST_LENGTH);
+    free(job.leaves);
+
+    return(0);
+}
+
+
+int image_digest_sign(char *path) {
+    unsigned char root[SHA256_DIGEST_LENGTH];
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    char line[256];
+    struct stat filestat;
+    int image_fd;
+
+    if ( ( image_fd = open(path, O_RDONLY) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+
+    if ( fstat(image_fd, &filestat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not stat image %s: %s\n", path, strerror(errno));
+        close(image_fd);
+        return(-1);
+    }
+
+    if ( image_digest(image_fd, 0, filestat.st_size, root) < 0 ) {
+        close(image_fd);
+        return(-1);
+    }
+    close(image_fd);
+
+    sha256_hex(root, hex);
+    snprintf(line, sizeof(line), "sha256-merkle %d %lld %s\n", DIGEST_CHUNK_SIZE, (long long)filestat.st_size, hex);
+
+    if ( fileput(strjoin(path, ".digest"), line) < 0 ) {
+        return(-1);
+    }
+
+    printf("%s\n", hex);
+
+    return(0);
+}
+
+
+// Returns 0 when the image matches its digest, 1 when the image has no
+// digest to check against, and -1 on mismatch or error. When a cache
+// directory is given a previous successful verification of the same file,
+// size and timestamps is trusted instead of hashing again. Only root may
+// write there, the entries are keyed on the open file itself.
+int image_digest_verify(char *path, int image_fd, char *cachedir) {
+    unsigned char root[SHA256_DIGEST_LENGTH];
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    char expected[SHA256_DIGEST_LENGTH * 2 + 1];
+    char *digest_path = strjoin(path, ".digest");
+    char *digest;
+    char *stamp;
+    char *cache = NULL;
+    struct stat filestat;
+    long long size;
+    int chunk_size;
+
+    if ( is_file(digest_path) < 0 ) {
+        free(digest_path);
+        return(1);
+    }
+
+    digest = filecat(digest_path);
+    free(digest_path);
+    if ( digest == NULL ) {
+        return(-1);
+    }
+
+    if ( sscanf(digest, "sha256-merkle %d %lld %64s", &chunk_size, &size, expected) != 3 || chunk_size != DIGEST_CHUNK_SIZE ) {
+        fprintf(stderr, "ERROR: Unrecognized image digest format: %s.digest\n", path);
+        free(digest);
+        return(-1);
+    }
+    free(digest);
+
+    if ( fstat(image_fd, &filestat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not stat image %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+
+    if ( (long long)filestat.st_size != size ) {
+        fprintf(stderr, "ERROR: Image size does not match its digest: %s\n", path);
+        return(-1);
+    }
+
+    stamp = (char *) malloc(512);
+    snprintf(stamp, 512, "%lu.%lu %lld %ld.%09ld %ld.%09ld %s", (unsigned long)filestat.st_dev, (unsigned long)filestat.st_ino, size, (long)filestat.st_mtim.tv_sec, filestat.st_mtim.tv_nsec, (long)filestat.st_ctim.tv_sec, filestat.st_ctim.tv_nsec, expected);
+
+    if ( cachedir != NULL && geteuid() == 0 ) {
+        if ( s_mkpath(cachedir, 0700) < 0 || is_owner(cachedir, 0) < 0 ) {
+            fprintf(stderr, "WARNING: Not caching verification, %s is unusable\n", cachedir);
+        } else {
+            cache = (char *) malloc(strlen(cachedir) + 64);
+            snprintf(cache, strlen(cachedir) + 64, "%s/%lu.%lu", cachedir, (unsigned long)filestat.st_dev, (unsigned long)filestat.st_ino);
+        }
+    }
+
+    if ( cache != NULL && is_file(cache) == 0 ) {
+        char *cached = filecat(cache);
+        if ( cached != NULL && strcmp(cached, stamp) == 0 ) {
+            free(cached);
+            free(cache);
+            free(stamp);
+            return(0);
+        }
+        free(cached);
+    }
+
+    if ( image_digest(image_fd, 0, size, root) < 0 ) {
+        free(cache);
+        free(stamp);
+        return(-1);
+    }
+
+    sha256_hex(root, hex);
+    if ( strcmp(hex, expected) != 0 ) {
+        fprintf(stderr, "ERROR: Image does not match its digest: %s\n", path);
+        free(cache);
+        free(stamp);
+        return(-1);
+    }
+
+    if ( cache != NULL ) {
+        fileput(cache, stamp);
+        free(cache);
+    }
+    free(stamp);
+
+    return(0);
+}
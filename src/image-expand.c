@@ -0,0 +1,78 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "image-util.h"
+#include "image-header.h"
+#include "util.h"
+
+
+int main(int argc, char ** argv) {
+    char *containerimage;
+    struct image_header header;
+    long long size;
+    int containerimage_fd;
+
+    if ( argv[1] == NULL || argv[2] == NULL ) {
+        fprintf(stderr, "USAGE: %s [singularity container image] [size to add in MB]\n", argv[0]);
+        return(1);
+    }
+
+    containerimage = strdup(argv[1]);
+    size = atoll(argv[2]) * 1024 * 1024;
+
+    if ( is_file(containerimage) < 0 ) {
+        fprintf(stderr, "ABORT: Container image not found: %s\n", containerimage);
+        return(1);
+    }
+
+    if ( size <= 0 ) {
+        fprintf(stderr, "ABORT: Invalid expansion size: %s\n", argv[2]);
+        return(1);
+    }
+
+    if ( ( containerimage_fd = open(containerimage, O_RDONLY) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", containerimage, strerror(errno));
+        return(255);
+    }
+    if ( image_header_read(containerimage_fd, &header, NULL, NULL) != 1 ) {
+        fprintf(stderr, "ABORT: Wrapped images can not be expanded, expand the raw image before wrapping it\n");
+        return(255);
+    }
+    close(containerimage_fd);
+
+    if ( image_expand(containerimage, size) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        return(255);
+    }
+
+    return(0);
+}
@@ -0,0 +1,165 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <endian.h>
+
+#include "config.h"
+#include "image-header.h"
+
+
+static char *header_field(char *block, uint32_t offset, uint32_t length) {
+    char *ret;
+
+    if ( length == 0 ) {
+        return(NULL);
+    }
+
+    ret = (char *) malloc(length + 1);
+    memcpy(ret, block + offset, length);
+    ret[length] = '\0';
+
+    return(ret);
+}
+
+
+// Returns 0 with the header (and optionally the runscript and environment)
+// filled in, 1 for a raw image without a header and -1 for a corrupt one.
+// Raw images report the whole file as the file system.
+int image_header_read(int image_fd, struct image_header *header, char **runscript, char **env) {
+    char *block = (char *) malloc(IMAGE_HEADER_SIZE);
+    struct stat filestat;
+    ssize_t len;
+
+    if ( runscript != NULL ) {
+        *runscript = NULL;
+    }
+    if ( env != NULL ) {
+        *env = NULL;
+    }
+
+    if ( fstat(image_fd, &filestat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not stat image: %s\n", strerror(errno));
+        free(block);
+        return(-1);
+    }
+
+    len = pread(image_fd, block, IMAGE_HEADER_SIZE, 0);
+
+    if ( len < (ssize_t)sizeof(struct image_header) || memcmp(block + IMAGE_HEADER_LAUNCHER_SIZE, IMAGE_HEADER_MAGIC, 8) != 0 ) {
+        memset(header, 0, sizeof(struct image_header));
+        header->fs_size = filestat.st_size;
+        free(block);
+        return(1);
+    }
+
+    memcpy(header, block, sizeof(struct image_header));
+    header->version = le32toh(header->version);
+    header->fs_offset = le64toh(header->fs_offset);
+    header->fs_size = le64toh(header->fs_size);
+    header->runscript_offset = le32toh(header->runscript_offset);
+    header->runscript_length = le32toh(header->runscript_length);
+    header->env_offset = le32toh(header->env_offset);
+    header->env_length = le32toh(header->env_length);
+
+    if ( header->version != IMAGE_HEADER_VERSION ) {
+        fprintf(stderr, "ERROR: Unsupported image header version: %u\n", header->version);
+        free(block);
+        return(-1);
+    }
+
+    if ( header->fs_offset < IMAGE_HEADER_SIZE || header->fs_offset > (uint64_t)filestat.st_size ||
+            header->fs_size > (uint64_t)filestat.st_size - header->fs_offset ||
+            len < IMAGE_HEADER_SIZE ||
+            (uint64_t)header->runscript_offset + header->runscript_length > IMAGE_HEADER_SIZE ||
+            (uint64_t)header->env_offset + header->env_length > IMAGE_HEADER_SIZE ) {
+        fprintf(stderr, "ERROR: Image header is corrupt\n");
+        free(block);
+        return(-1);
+    }
+
+    if ( runscript != NULL ) {
+        *runscript = header_field(block, header->runscript_offset, header->runscript_length);
+    }
+    if ( env != NULL ) {
+        *env = header_field(block, header->env_offset, header->env_length);
+    }
+
+    free(block);
+
+    return(0);
+}
+
+
+// Writes the header block, laying out the runscript and environment after
+// the fixed fields. The caller fills in the file system offset, size and
+// hash.
+int image_header_write(int image_fd, struct image_header *header, char *runscript, char *env) {
+    char *block = (char *) calloc(1, IMAGE_HEADER_SIZE);
+    struct image_header *out = (struct image_header *) block;
+    uint32_t runscript_length = ( runscript != NULL ) ? strlen(runscript) : 0;
+    uint32_t env_length = ( env != NULL ) ? strlen(env) : 0;
+    uint32_t pos = 512;
+
+    if ( pos + runscript_length + env_length > IMAGE_HEADER_SIZE ) {
+        fprintf(stderr, "ERROR: Runscript and environment do not fit in the %d byte image header\n", IMAGE_HEADER_SIZE);
+        free(block);
+        return(-1);
+    }
+
+    memcpy(out, header, sizeof(struct image_header));
+    memset(out->launcher, 0, IMAGE_HEADER_LAUNCHER_SIZE);
+    memcpy(out->launcher, IMAGE_HEADER_LAUNCHER, strlen(IMAGE_HEADER_LAUNCHER));
+    memcpy(out->magic, IMAGE_HEADER_MAGIC, 8);
+    out->version = htole32(IMAGE_HEADER_VERSION);
+    out->reserved = 0;
+    out->fs_offset = htole64(header->fs_offset);
+    out->fs_size = htole64(header->fs_size);
+
+    out->runscript_offset = htole32(pos);
+    out->runscript_length = htole32(runscript_length);
+    if ( runscript_length > 0 ) {
+        memcpy(block + pos, runscript, runscript_length);
+    }
+    pos += runscript_length;
+
+    out->env_offset = htole32(pos);
+    out->env_length = htole32(env_length);
+    if ( env_length > 0 ) {
+        memcpy(block + pos, env, env_length);
+    }
+
+    if ( pwrite(image_fd, block, IMAGE_HEADER_SIZE, 0) != IMAGE_HEADER_SIZE ) {
+        fprintf(stderr, "ERROR: Could not write image header: %s\n", strerror(errno));
+        free(block);
+        return(-1);
+    }
+
+    free(block);
+
+    return(0);
+}
@@ -0,0 +1,47 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+
+#define IMAGE_HEADER_SIZE 65536
+#define IMAGE_HEADER_MAGIC "SINGHDR1"
+#define IMAGE_HEADER_VERSION 1
+#define IMAGE_HEADER_LAUNCHER "#!/usr/bin/env sapprun\n"
+#define IMAGE_HEADER_LAUNCHER_SIZE 256
+
+// Fixed size header in front of the file system of a wrapped image. The
+// launcher line makes the image directly executable, the runscript and
+// default environment are stored in the rest of the header block so one
+// read returns all of the metadata. Integers are little endian on disk.
+struct image_header {
+    char launcher[IMAGE_HEADER_LAUNCHER_SIZE];
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t fs_offset;
+    uint64_t fs_size;
+    uint32_t runscript_offset;
+    uint32_t runscript_length;
+    uint32_t env_offset;
+    uint32_t env_length;
+    unsigned char fs_hash[32];
+} __attribute__((packed));
+
+int image_header_read(int image_fd, struct image_header *header, char **runscript, char **env);
+int image_header_write(int image_fd, struct image_header *header, char *runscript, char *env);
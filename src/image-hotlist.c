@@ -0,0 +1,71 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "image-prefetch.h"
+#include "util.h"
+
+
+int main(int argc, char ** argv) {
+    char *containerimage;
+    char *hotlist;
+    long long bytes = 0;
+    int image_fd;
+
+    if ( argc != 2 ) {
+        fprintf(stderr, "USAGE: %s [singularity container image]\n", argv[0]);
+        return(1);
+    }
+
+    containerimage = strdup(argv[1]);
+    hotlist = strjoin(containerimage, PREFETCH_HOTLIST_SUFFIX);
+
+    if ( is_file(containerimage) < 0 ) {
+        fprintf(stderr, "ABORT: Container image not found: %s\n", containerimage);
+        return(1);
+    }
+
+    if ( ( image_fd = open(containerimage, O_RDONLY) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", containerimage, strerror(errno));
+        return(255);
+    }
+
+    if ( image_hotlist_record(image_fd, hotlist, &bytes) < 0 ) {
+        fprintf(stderr, "ABORT: Could not record hot list for %s\n", containerimage);
+        return(255);
+    }
+
+    close(image_fd);
+
+    printf("Recorded %s (%lld MB of the image is cached)\n", hotlist, bytes / 1024 / 1024);
+
+    return(0);
+}
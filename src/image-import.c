@@ -0,0 +1,379 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <sched.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "image-util.h"
+#include "mounts.h"
+#include "util.h"
+#include "loop-control.h"
+
+#define TAR_BLOCK 512
+#define FS_BLOCK 4096
+
+// Size used when the archive can not be scanned ahead of time (a pipe or
+// a compressed archive). The image is sparse and is shrunk to fit after.
+#define STREAM_IMAGE_SIZE (64LL * 1024 * 1024 * 1024)
+
+
+static long long tar_number(unsigned char *field, int len) {
+    long long ret = 0;
+    int i;
+
+    // GNU base-256 encoding for values that do not fit in octal
+    if ( field[0] & 0x80 ) {
+        ret = field[0] & 0x7f;
+        for ( i = 1; i < len; i++ ) {
+            ret = ( ret << 8 ) | field[i];
+        }
+        return(ret);
+    }
+
+    for ( i = 0; i < len && field[i] != '\0'; i++ ) {
+        if ( field[i] >= '0' && field[i] <= '7' ) {
+            ret = ( ret << 3 ) + ( field[i] - '0' );
+        }
+    }
+
+    return(ret);
+}
+
+
+// Walk the headers of an uncompressed tar file, skipping over the data, to
+// find out how much space and how many inodes the extracted tree will need.
+static int tar_scan(int tar_fd, long long *bytes, long long *entries) {
+    unsigned char header[TAR_BLOCK];
+    long long pax_size = -1;
+
+    *bytes = 0;
+    *entries = 0;
+
+    while ( read(tar_fd, header, TAR_BLOCK) == TAR_BLOCK ) {
+        long long size;
+        char type;
+
+        if ( header[0] == '\0' ) {
+            return(0);
+        }
+
+        if ( strncmp((char *)header + 257, "ustar", 5) != 0 ) {
+            return(-1);
+        }
+
+        size = tar_number(header + 124, 12);
+        type = header[156];
+
+        if ( type == 'x' ) {
+            char *pax;
+            char *record;
+
+            if ( size > 1024 * 1024 || ( pax = (char *) malloc(size + 1) ) == NULL ) {
+                return(-1);
+            }
+            if ( read(tar_fd, pax, size) != size ) {
+                free(pax);
+                return(-1);
+            }
+            pax[size] = '\0';
+            // Records are "<length> <key>=<value>\n", the length covering
+            // the whole record, so values can not be mistaken for keys
+            record = pax;
+            while ( record < pax + size ) {
+                char *key;
+                long long length = strtoll(record, &key, 10);
+
+                if ( key == record || *key != ' ' || length <= key - record || length > pax + size - record ) {
+                    break;
+                }
+                if ( strncmp(key + 1, "size=", 5) == 0 ) {
+                    pax_size = strtoll(key + 6, NULL, 10);
+                }
+                record += length;
+            }
+            free(pax);
+            if ( lseek(tar_fd, ( TAR_BLOCK - size % TAR_BLOCK ) % TAR_BLOCK, SEEK_CUR) < 0 ) {
+                return(-1);
+            }
+            continue;
+        }
+
+        if ( pax_size >= 0 ) {
+            size = pax_size;
+            pax_size = -1;
+        }
+
+        if ( type != 'g' && type != 'L' && type != 'K' ) {
+            *entries += 1;
+            if ( type == '0' || type == '\0' || type == '5' ) {
+                *bytes += ( size + FS_BLOCK - 1 ) / FS_BLOCK * FS_BLOCK;
+            }
+            if ( type == '5' ) {
+                *bytes += FS_BLOCK;
+            }
+        }
+
+        // Hard links, symlinks and directories carry no data
+        if ( type == '1' || type == '2' || type == '5' ) {
+            continue;
+        }
+
+        if ( lseek(tar_fd, ( size + TAR_BLOCK - 1 ) / TAR_BLOCK * TAR_BLOCK, SEEK_CUR) < 0 ) {
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+
+static int tar_extract(char *containerimage, int containerimage_fd, char *tarball) {
+    char mountpoint[] = "/tmp/.singularity-import.XXXXXX";
+    char *tar_argv[] = { "tar", "-x", "-p", "--numeric-owner", "--xattrs", "--xattrs-include=*", "--acls", "-C", mountpoint, "-f", tarball, NULL };
+    char *loop_dev;
+
+    if ( geteuid() != 0 ) {
+        fprintf(stderr, "ERROR: Importing with this version of mkfs.ext4 requires root\n");
+        return(-1);
+    }
+
+    if ( unshare(CLONE_NEWNS) < 0 ) {
+        fprintf(stderr, "ERROR: Could not virtulize mount namespace\n");
+        return(-1);
+    }
+
+    if ( mount(NULL, "/", NULL, MS_PRIVATE|MS_REC, NULL) < 0 ) {
+        fprintf(stderr, "ERROR: Could not make mountspaces private: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    if ( mkdtemp(mountpoint) == NULL ) {
+        fprintf(stderr, "ERROR: Could not create temporary mount point: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    if ( ( loop_dev = obtain_loop_dev() ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not obtain a loop device\n");
+        rmdir(mountpoint);
+        return(-1);
+    }
+
+    if ( associate_loop(containerimage_fd, loop_dev, 0, 0) < 0 ) {
+        fprintf(stderr, "ERROR: Could not associate %s to loop device %s\n", containerimage, loop_dev);
+        rmdir(mountpoint);
+        return(-1);
+    }
+
+    if ( mount_image(loop_dev, mountpoint, 1, "build") < 0 ) {
+        rmdir(mountpoint);
+        return(-1);
+    }
+
+    if ( s_spawn(tar_argv) != 0 ) {
+        fprintf(stderr, "ERROR: Failed to extract %s into image\n", tarball);
+        umount(mountpoint);
+        rmdir(mountpoint);
+        return(-1);
+    }
+
+    mount_image_trim(mountpoint, "build");
+
+    if ( umount(mountpoint) < 0 ) {
+        fprintf(stderr, "ERROR: Could not unmount %s: %s\n", mountpoint, strerror(errno));
+        return(-1);
+    }
+
+    rmdir(mountpoint);
+
+    return(0);
+}
+
+
+// mke2fs can only read a tar archive from a file, so stdin is copied to
+// one first. Returns the file name, removed again by the caller.
+static char *tar_spool(void) {
+    char *tmpdir = getenv("TMPDIR");
+    char *spool;
+    char buff[65536];
+    ssize_t count;
+    int spool_fd;
+
+    spool = joinpath(( tmpdir != NULL && tmpdir[0] != '\0' ) ? tmpdir : "/tmp", ".singularity-import.XXXXXX");
+    if ( ( spool_fd = mkstemp(spool) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not create %s: %s\n", spool, strerror(errno));
+        return(NULL);
+    }
+
+    while ( ( count = read(STDIN_FILENO, buff, sizeof(buff)) ) > 0 ) {
+        if ( write(spool_fd, buff, count) != count ) {
+            count = -1;
+            break;
+        }
+    }
+
+    if ( count < 0 || close(spool_fd) < 0 ) {
+        fprintf(stderr, "ERROR: Could not copy the archive from stdin to %s: %s\n", spool, strerror(errno));
+        unlink(spool);
+        return(NULL);
+    }
+
+    return(spool);
+}
+
+
+int main(int argc, char ** argv) {
+    struct image_format_opts opts;
+    char *containerimage;
+    char *tarball;
+    char *spool = NULL;
+    long long size;
+    long long bytes = 0;
+    long long entries = 0;
+    int containerimage_fd;
+    int tar_fd;
+    int streaming = 1;
+    int populated = 0;
+    int retval = 0;
+
+    if ( argv[1] == NULL || argv[2] == NULL || argv[3] == NULL ) {
+        fprintf(stderr, "USAGE: %s [singularity container image] [tar archive or -] [size in MB or 0]\n", argv[0]);
+        return(1);
+    }
+
+    containerimage = strdup(argv[1]);
+    size = atoll(argv[3]) * 1024 * 1024;
+
+    if ( strcmp(argv[2], "-") == 0 ) {
+        tarball = strdup("-");
+    } else {
+        tarball = strdup(argv[2]);
+        if ( is_file(tarball) < 0 ) {
+            fprintf(stderr, "ABORT: Tar archive not found: %s\n", tarball);
+            return(1);
+        }
+    }
+
+    opts.journal = 0;
+    opts.inode_ratio = 8192;
+    opts.inode_count = 0;
+    opts.populate = NULL;
+    opts.uuid = NULL;
+    opts.timestamp = 0;
+
+    if ( getenv("SINGULARITY_IMAGE_JOURNAL") != NULL ) {
+        opts.journal = 1;
+    }
+
+    // Without tar support in mke2fs, tar reads stdin into the mounted image
+    // as it arrives and there is nothing to gain from a copy
+    if ( strcmp(tarball, "-") == 0 && image_format_can_populate_tar() ) {
+        if ( ( spool = tar_spool() ) == NULL ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+        tarball = spool;
+    }
+
+    if ( strcmp(tarball, "-") != 0 ) {
+        if ( ( tar_fd = open(tarball, O_RDONLY) ) < 0 ) {
+            fprintf(stderr, "ERROR: Could not open %s: %s\n", tarball, strerror(errno));
+            if ( spool != NULL ) {
+                unlink(spool);
+            }
+            return(255);
+        }
+        if ( tar_scan(tar_fd, &bytes, &entries) == 0 && entries > 0 ) {
+            streaming = 0;
+        }
+        close(tar_fd);
+    }
+
+    if ( size <= 0 ) {
+        if ( streaming == 0 ) {
+            size = image_size_for_content(bytes, entries, &opts);
+        } else {
+            size = STREAM_IMAGE_SIZE;
+        }
+    }
+
+    printf("Creating image of %lldMB for %lld archive entries...\n", size / 1024 / 1024, entries);
+
+    if ( image_create(containerimage, size, 0) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        retval = 255;
+    }
+
+    // A single pass through mke2fs when it can read the archive itself,
+    // otherwise the image is mounted and tar extracts into it as root
+    if ( retval == 0 && strcmp(tarball, "-") != 0 && image_format_can_populate_tar() ) {
+        opts.populate = tarball;
+        if ( image_format(containerimage, &opts) == 0 ) {
+            populated = 1;
+        } else {
+            fprintf(stderr, "WARNING: mkfs.ext4 could not populate from %s, extracting instead\n", tarball);
+            opts.populate = NULL;
+        }
+    }
+
+    if ( retval == 0 && populated == 0 && image_format(containerimage, &opts) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        retval = 255;
+    }
+
+    if ( retval == 0 && ( containerimage_fd = open(containerimage, O_RDWR) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", containerimage, strerror(errno));
+        retval = 255;
+    }
+
+    if ( retval == 0 && populated == 0 && tar_extract(containerimage, containerimage_fd, tarball) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        retval = 255;
+    }
+
+    if ( spool != NULL ) {
+        unlink(spool);
+    }
+
+    if ( retval != 0 ) {
+        return(retval);
+    }
+
+    if ( streaming == 1 && atoll(argv[3]) <= 0 ) {
+        printf("Shrinking image to fit contents...\n");
+        if ( image_shrink(containerimage, containerimage_fd) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+    }
+
+    close(containerimage_fd);
+
+    return(0);
+}
@@ -0,0 +1,88 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "image-header.h"
+#include "sha256.h"
+#include "util.h"
+
+
+int main(int argc, char ** argv) {
+    struct image_header header;
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    char *containerimage;
+    char *runscript;
+    char *env;
+    int containerimage_fd;
+    int retval;
+
+    if ( argv[1] == NULL ) {
+        fprintf(stderr, "USAGE: %s [singularity container image]\n", argv[0]);
+        return(1);
+    }
+
+    containerimage = strdup(argv[1]);
+
+    if ( ( containerimage_fd = open(containerimage, O_RDONLY) ) < 0 ) {
+        fprintf(stderr, "ABORT: Could not open image %s: %s\n", containerimage, strerror(errno));
+        return(255);
+    }
+
+    if ( ( retval = image_header_read(containerimage_fd, &header, &runscript, &env) ) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        return(255);
+    }
+    close(containerimage_fd);
+
+    printf("Image:        %s\n", containerimage);
+
+    if ( retval == 1 ) {
+        printf("Format:       raw\n");
+        printf("Size:         %llu\n", (unsigned long long)header.fs_size);
+        return(0);
+    }
+
+    sha256_hex(header.fs_hash, hex);
+    printf("Format:       wrapped (header version %u)\n", header.version);
+    printf("FS offset:    %llu\n", (unsigned long long)header.fs_offset);
+    printf("FS size:      %llu\n", (unsigned long long)header.fs_size);
+    printf("FS hash:      sha256-merkle %s\n", hex);
+    printf("Runscript:    %s\n", ( runscript != NULL ) ? "" : "(none)");
+    if ( runscript != NULL ) {
+        printf("%s%s", runscript, runscript[strlen(runscript) - 1] == '\n' ? "" : "\n");
+    }
+    printf("Environment:  %s\n", ( env != NULL ) ? "" : "(none)");
+    if ( env != NULL ) {
+        printf("%s%s", env, env[strlen(env) - 1] == '\n' ? "" : "\n");
+    }
+
+    return(0);
+}
@@ -0,0 +1,159 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/falloc.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "image-delta.h"
+#include "image-digest.h"
+#include "image-util.h"
+#include "sha256.h"
+#include "util.h"
+
+
+static int patch_apply(FILE *delta, int old_fd, int out_fd) {
+    struct delta_op op;
+    unsigned char *buff;
+
+    buff = (unsigned char *) malloc(DELTA_CHUNK_SIZE);
+
+    while ( fread(&op, sizeof(op), 1, delta) == 1 ) {
+        uint64_t pos;
+
+        if ( op.type == DELTA_END ) {
+            free(buff);
+            return(0);
+        }
+
+        for ( pos = 0; pos < op.length; pos += DELTA_CHUNK_SIZE ) {
+            size_t len = ( op.length - pos ) < DELTA_CHUNK_SIZE ? ( op.length - pos ) : DELTA_CHUNK_SIZE;
+
+            if ( op.type == DELTA_DATA ) {
+                if ( fread(buff, len, 1, delta) != 1 ) {
+                    fprintf(stderr, "ERROR: Delta file is truncated\n");
+                    free(buff);
+                    return(-1);
+                }
+            } else if ( op.type == DELTA_COPY ) {
+                if ( pread(old_fd, buff, len, op.source + pos) != (ssize_t)len ) {
+                    fprintf(stderr, "ERROR: Could not read old image: %s\n", strerror(errno));
+                    free(buff);
+                    return(-1);
+                }
+            } else if ( op.type == DELTA_ZERO ) {
+                continue;
+            } else {
+                fprintf(stderr, "ERROR: Unknown delta operation: %u\n", op.type);
+                free(buff);
+                return(-1);
+            }
+
+            if ( pwrite(out_fd, buff, len, op.offset + pos) != (ssize_t)len ) {
+                fprintf(stderr, "ERROR: Could not write image: %s\n", strerror(errno));
+                free(buff);
+                return(-1);
+            }
+        }
+
+        if ( op.type == DELTA_ZERO ) {
+            if ( fallocate(out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, op.offset, op.length) < 0 ) {
+                fprintf(stderr, "ERROR: Could not punch hole in image: %s\n", strerror(errno));
+                free(buff);
+                return(-1);
+            }
+        }
+    }
+
+    fprintf(stderr, "ERROR: Delta file is truncated\n");
+    free(buff);
+    return(-1);
+}
+
+
+int main(int argc, char ** argv) {
+    struct delta_header header;
+    struct stat old_stat;
+    unsigned char root[SHA256_DIGEST_LENGTH];
+    char *output;
+    FILE *delta;
+    int old_fd;
+    int out_fd;
+
+    if ( argv[1] == NULL || argv[2] == NULL || argv[3] == NULL ) {
+        fprintf(stderr, "USAGE: %s [old image] [delta file] [new image]\n", argv[0]);
+        return(1);
+    }
+
+    output = strdup(argv[3]);
+
+    if ( ( old_fd = open(argv[1], O_RDONLY) ) < 0 || fstat(old_fd, &old_stat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", argv[1], strerror(errno));
+        return(255);
+    }
+
+    if ( ( delta = fopen(argv[2], "r") ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not open delta %s: %s\n", argv[2], strerror(errno));
+        return(255);
+    }
+
+    if ( fread(&header, sizeof(header), 1, delta) != 1 || memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) != 0 || header.chunk_size != DELTA_CHUNK_SIZE ) {
+        fprintf(stderr, "ABORT: Not a Singularity image delta: %s\n", argv[2]);
+        return(1);
+    }
+
+    if ( (uint64_t)old_stat.st_size != header.old_size || image_digest(old_fd, 0, old_stat.st_size, root) < 0 || memcmp(root, header.old_root, SHA256_DIGEST_LENGTH) != 0 ) {
+        fprintf(stderr, "ABORT: Delta was not made against this image: %s\n", argv[1]);
+        return(1);
+    }
+
+    if ( ( out_fd = open(output, O_CREAT | O_EXCL | O_RDWR, 0644) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not create image %s: %s\n", output, strerror(errno));
+        return(255);
+    }
+
+    // Start from the old contents at the same offsets, then apply changes
+    if ( ftruncate(out_fd, header.new_size) < 0 || image_copy_data(old_fd, 0, out_fd, 0, header.new_size < header.old_size ? header.new_size : header.old_size) < 0 || patch_apply(delta, old_fd, out_fd) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        unlink(output);
+        return(255);
+    }
+
+    if ( image_digest(out_fd, 0, header.new_size, root) < 0 || memcmp(root, header.new_root, SHA256_DIGEST_LENGTH) != 0 ) {
+        fprintf(stderr, "ABORT: Patched image does not match the expected result\n");
+        unlink(output);
+        return(255);
+    }
+
+    fclose(delta);
+    close(out_fd);
+    close(old_fd);
+
+    return(0);
+}
@@ -0,0 +1,358 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "image-prefetch.h"
+#include "util.h"
+
+
+struct prefetch_range {
+    long long offset;
+    long long length;
+};
+
+struct prefetch_job {
+    int fd;
+    struct prefetch_range *ranges;
+    long long count;
+    long long alloc;
+    long long next;
+    long long bytes;
+    int error;
+    pthread_mutex_t lock;
+};
+
+
+// Queue a range, split into chunks so the threads share the work evenly
+static int prefetch_add(struct prefetch_job *job, long long offset, long long length) {
+    while ( length > 0 ) {
+        long long len = ( length > PREFETCH_CHUNK_SIZE ) ? PREFETCH_CHUNK_SIZE : length;
+
+        if ( job->count == job->alloc ) {
+            struct prefetch_range *ranges;
+
+            job->alloc = ( job->alloc > 0 ) ? job->alloc * 2 : 256;
+            if ( ( ranges = (struct prefetch_range *) realloc(job->ranges, job->alloc * sizeof(struct prefetch_range)) ) == NULL ) {
+                fprintf(stderr, "ERROR: Could not allocate memory for image prefetch\n");
+                return(-1);
+            }
+            job->ranges = ranges;
+        }
+
+        job->ranges[job->count].offset = offset;
+        job->ranges[job->count].length = len;
+        job->count++;
+
+        offset += len;
+        length -= len;
+    }
+
+    return(0);
+}
+
+
+// Every data extent of the image, holes are never read
+static int prefetch_add_extents(struct prefetch_job *job) {
+    struct stat filestat;
+    off_t data;
+    off_t hole;
+
+    if ( fstat(job->fd, &filestat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not stat image: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    for ( data = 0; data < filestat.st_size; data = hole ) {
+        if ( ( data = lseek(job->fd, data, SEEK_DATA) ) < 0 ) {
+            if ( errno == ENXIO ) {
+                break;
+            }
+            // No SEEK_DATA support, read it all
+            return(prefetch_add(job, 0, filestat.st_size));
+        }
+        if ( ( hole = lseek(job->fd, data, SEEK_HOLE) ) < 0 ) {
+            hole = filestat.st_size;
+        }
+        if ( prefetch_add(job, data, hole - data) < 0 ) {
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+
+static int prefetch_add_hotlist(struct prefetch_job *job, int hotlist_fd) {
+    char line[256];
+    int lineno = 0;
+    FILE *fp;
+
+    if ( ( fp = fdopen(dup(hotlist_fd), "r") ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not read hot list: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    while ( fgets(line, sizeof(line), fp) != NULL ) {
+        long long offset;
+        long long length;
+
+        lineno++;
+        if ( line[0] == '#' || line[0] == '\n' ) {
+            continue;
+        }
+        if ( sscanf(line, "%lld %lld", &offset, &length) != 2 || offset < 0 || length < 0 ) {
+            fprintf(stderr, "ERROR: Malformed hot list at line %d\n", lineno);
+            fclose(fp);
+            return(-1);
+        }
+        if ( prefetch_add(job, offset, length) < 0 ) {
+            fclose(fp);
+            return(-1);
+        }
+    }
+
+    fclose(fp);
+
+    return(0);
+}
+
+
+static void *prefetch_worker(void *arg) {
+    struct prefetch_job *job = (struct prefetch_job *) arg;
+    char *buff = NULL;
+
+    while ( 1 ) {
+        long long index;
+        long long pos;
+        struct prefetch_range *range;
+
+        pthread_mutex_lock(&job->lock);
+        index = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if ( index >= job->count || job->error != 0 ) {
+            break;
+        }
+        range = &job->ranges[index];
+
+        // readahead() fills the page cache without copying anything out,
+        // file systems that do not support it are read the plain way
+        if ( readahead(job->fd, range->offset, range->length) == 0 ) {
+            pos = range->length;
+        } else {
+            if ( buff == NULL && ( buff = (char *) malloc(PREFETCH_CHUNK_SIZE) ) == NULL ) {
+                job->error = ENOMEM;
+                break;
+            }
+            for ( pos = 0; pos < range->length; ) {
+                ssize_t ret = pread(job->fd, buff, range->length - pos, range->offset + pos);
+                if ( ret < 0 ) {
+                    job->error = errno;
+                    break;
+                } else if ( ret == 0 ) {
+                    break;
+                }
+                pos += ret;
+            }
+        }
+
+        pthread_mutex_lock(&job->lock);
+        job->bytes += pos;
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    free(buff);
+
+    return(NULL);
+}
+
+
+// Pull the image into the page cache with several reads in flight, which
+// is what fast parallel and network file systems need to get up to speed.
+// With a hot list only the ranges it names are read.
+int image_prefetch(int image_fd, int hotlist_fd, long long *bytes) {
+    struct prefetch_job job;
+    pthread_t threads[PREFETCH_MAX_THREADS];
+    long nthreads;
+    long i;
+    int retval;
+
+    memset(&job, 0, sizeof(job));
+    job.fd = image_fd;
+
+    if ( hotlist_fd >= 0 ) {
+        retval = prefetch_add_hotlist(&job, hotlist_fd);
+    } else {
+        retval = prefetch_add_extents(&job);
+    }
+    if ( retval < 0 ) {
+        free(job.ranges);
+        return(-1);
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+
+    nthreads = PREFETCH_MAX_THREADS;
+    if ( nthreads > job.count ) {
+        nthreads = job.count;
+    }
+
+    // The calling thread takes ranges as well, so a failure to start
+    // threads only costs parallelism
+    for ( i = 0; i < nthreads - 1; i++ ) {
+        if ( pthread_create(&threads[i], NULL, prefetch_worker, &job) != 0 ) {
+            break;
+        }
+    }
+    nthreads = i;
+
+    prefetch_worker(&job);
+
+    for ( i = 0; i < nthreads; i++ ) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    free(job.ranges);
+
+    if ( job.error != 0 ) {
+        fprintf(stderr, "ERROR: Could not read image for prefetch: %s\n", strerror(job.error));
+        return(-1);
+    }
+
+    if ( bytes != NULL ) {
+        *bytes = job.bytes;
+    }
+
+    return(0);
+}
+
+
+// Write the ranges of the image that are in the page cache right now, e.g.
+// after a typical job ran, as a hot list for later prefetches. Ranges closer
+// than PREFETCH_MERGE_GAP are merged to keep the list and the reads few.
+int image_hotlist_record(int image_fd, char *hotlist, long long *bytes) {
+    struct stat filestat;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    long long window = 1024LL * 1024 * 1024;
+    long long start = -1;
+    long long end = 0;
+    long long total = 0;
+    long long offset;
+    unsigned char *vec;
+    char *tmpfile;
+    FILE *fp;
+
+    if ( fstat(image_fd, &filestat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not stat image: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    if ( ( vec = (unsigned char *) malloc(window / pagesize) ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not allocate memory for hot list\n");
+        return(-1);
+    }
+
+    tmpfile = strjoin(hotlist, ".new");
+    if ( ( fp = fopen(tmpfile, "w") ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", tmpfile, strerror(errno));
+        free(vec);
+        return(-1);
+    }
+    fprintf(fp, "# Singularity image hot list: offset length\n");
+
+    for ( offset = 0; offset < filestat.st_size; offset += window ) {
+        long long len = filestat.st_size - offset;
+        long long page;
+        void *map;
+
+        if ( len > window ) {
+            len = window;
+        }
+
+        if ( ( map = mmap(NULL, len, PROT_READ, MAP_SHARED, image_fd, offset) ) == MAP_FAILED ) {
+            fprintf(stderr, "ERROR: Could not map image: %s\n", strerror(errno));
+            break;
+        }
+        if ( mincore(map, len, vec) < 0 ) {
+            fprintf(stderr, "ERROR: Could not query page cache: %s\n", strerror(errno));
+            munmap(map, len);
+            break;
+        }
+        munmap(map, len);
+
+        for ( page = 0; page < ( len + pagesize - 1 ) / pagesize; page++ ) {
+            long long pos = offset + page * pagesize;
+
+            if ( ( vec[page] & 1 ) == 0 ) {
+                continue;
+            }
+            total += pagesize;
+            if ( start >= 0 && pos - end <= PREFETCH_MERGE_GAP ) {
+                end = pos + pagesize;
+                continue;
+            }
+            if ( start >= 0 ) {
+                fprintf(fp, "%lld %lld\n", start, end - start);
+            }
+            start = pos;
+            end = pos + pagesize;
+        }
+    }
+
+    if ( start >= 0 ) {
+        fprintf(fp, "%lld %lld\n", start, end - start);
+    }
+    free(vec);
+
+    if ( fclose(fp) != 0 || offset < filestat.st_size ) {
+        unlink(tmpfile);
+        free(tmpfile);
+        return(-1);
+    }
+
+    if ( rename(tmpfile, hotlist) < 0 ) {
+        fprintf(stderr, "ERROR: Could not install hot list %s: %s\n", hotlist, strerror(errno));
+        unlink(tmpfile);
+        free(tmpfile);
+        return(-1);
+    }
+    free(tmpfile);
+
+    if ( bytes != NULL ) {
+        *bytes = total;
+    }
+
+    return(0);
+}
@@ -0,0 +1,28 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+
+#define PREFETCH_CHUNK_SIZE (4 * 1024 * 1024)
+#define PREFETCH_MAX_THREADS 16
+#define PREFETCH_MERGE_GAP (1024 * 1024)
+#define PREFETCH_HOTLIST_SUFFIX ".hot"
+
+int image_prefetch(int image_fd, int hotlist_fd, long long *bytes);
+int image_hotlist_record(int image_fd, char *hotlist, long long *bytes);
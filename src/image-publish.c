@@ -0,0 +1,193 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+
+#include "config.h"
+#include "image-util.h"
+#include "image-version.h"
+#include "util.h"
+
+
+// Versions are numbered files in <name>.versions, returns the highest
+static long latest_version(char *versions) {
+    struct dirent *entry;
+    long latest = 0;
+    DIR *dir;
+
+    if ( ( dir = opendir(versions) ) == NULL ) {
+        return(0);
+    }
+
+    while ( ( entry = readdir(dir) ) != NULL ) {
+        char *end;
+        long version = strtol(entry->d_name, &end, 10);
+
+        if ( end != entry->d_name && strcmp(end, ".img") == 0 && version > latest ) {
+            latest = version;
+        }
+    }
+
+    closedir(dir);
+
+    return(latest);
+}
+
+
+// Retire every version but the current one, releasing those that are
+// not in use right away
+static void retire_versions(char *versions, long current) {
+    struct dirent *entry;
+    DIR *dir;
+
+    if ( ( dir = opendir(versions) ) == NULL ) {
+        return;
+    }
+
+    while ( ( entry = readdir(dir) ) != NULL ) {
+        char *end;
+        long version = strtol(entry->d_name, &end, 10);
+        char *path;
+
+        if ( end == entry->d_name || strcmp(end, ".img") != 0 || version == current ) {
+            continue;
+        }
+
+        path = joinpath(versions, entry->d_name);
+        if ( image_version_retire(path) == 0 && is_file(path) == 0 ) {
+            printf("Version %ld is still in use, it will be removed when its last user exits\n", version);
+        }
+        free(path);
+    }
+
+    closedir(dir);
+}
+
+
+int main(int argc, char ** argv) {
+    char *srcimage;
+    char *name;
+    char *versions;
+    char *version_file;
+    char *tmpfile;
+    char *link_target;
+    char *tmplink;
+    char *digest;
+    struct stat filestat;
+    long version;
+    int src_fd;
+    int dst_fd;
+    int lock_fd;
+
+    if ( argc != 3 ) {
+        fprintf(stderr, "USAGE: %s [image] [published name]\n", argv[0]);
+        return(1);
+    }
+
+    srcimage = strdup(argv[1]);
+    name = strdup(argv[2]);
+    versions = strjoin(name, IMAGE_VERSION_SUFFIX);
+
+    if ( lstat(name, &filestat) == 0 && ! S_ISLNK(filestat.st_mode) ) {
+        fprintf(stderr, "ABORT: %s exists and is not a published image\n", name);
+        return(1);
+    }
+
+    if ( ( src_fd = open(srcimage, O_RDONLY) ) < 0 || fstat(src_fd, &filestat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", srcimage, strerror(errno));
+        return(255);
+    }
+
+    if ( flock(src_fd, LOCK_SH | LOCK_NB) < 0 ) {
+        fprintf(stderr, "ABORT: Image is in use writable by another process: %s\n", srcimage);
+        return(5);
+    }
+
+    if ( s_mkpath(versions, 0755) < 0 ) {
+        fprintf(stderr, "ABORT: Could not create %s: %s\n", versions, strerror(errno));
+        return(255);
+    }
+
+    version = latest_version(versions) + 1;
+    version_file = joinpath(versions, strjoin(int2str(version), ".img"));
+    tmpfile = strjoin(version_file, ".new");
+
+    // Versions are immutable, running launches depend on that
+    if ( ( dst_fd = open(tmpfile, O_CREAT | O_EXCL | O_WRONLY, 0600) ) < 0 ) {
+        fprintf(stderr, "ABORT: Could not create %s: %s\n", tmpfile, strerror(errno));
+        return(255);
+    }
+
+    if ( image_clone(src_fd, dst_fd, filestat.st_size) == NULL || fchmod(dst_fd, filestat.st_mode & 0555) < 0 || fsync(dst_fd) < 0 || close(dst_fd) < 0 ) {
+        fprintf(stderr, "ABORT: Could not copy %s to %s\n", srcimage, tmpfile);
+        unlink(tmpfile);
+        return(255);
+    }
+    close(src_fd);
+
+    // The digest covers the content, so it holds for the copy as well
+    if ( is_file(strjoin(srcimage, ".digest")) == 0 && ( digest = filecat(strjoin(srcimage, ".digest")) ) != NULL ) {
+        if ( fileput(strjoin(version_file, ".digest"), digest) < 0 ) {
+            fprintf(stderr, "WARNING: Could not copy the image digest to %s\n", version_file);
+        }
+    }
+
+    // Launches on every host sharing the image hold the version through
+    // its lock file, it has to be there before the version can be used
+    if ( ( lock_fd = open(strjoin(version_file, IMAGE_VERSION_LOCK), O_CREAT | O_WRONLY | O_NOFOLLOW, 0644) ) < 0 ) {
+        fprintf(stderr, "ABORT: Could not create the lock file for %s: %s\n", version_file, strerror(errno));
+        unlink(tmpfile);
+        return(255);
+    }
+    close(lock_fd);
+
+    if ( rename(tmpfile, version_file) < 0 ) {
+        fprintf(stderr, "ABORT: Could not publish %s: %s\n", version_file, strerror(errno));
+        unlink(tmpfile);
+        return(255);
+    }
+
+    // New launches resolve the name to the new version from here on
+    link_target = joinpath(strjoin(basename(strdup(name)), IMAGE_VERSION_SUFFIX), strjoin(int2str(version), ".img"));
+    tmplink = strjoin(name, ".new-link");
+    unlink(tmplink);
+    if ( symlink(link_target, tmplink) < 0 || rename(tmplink, name) < 0 ) {
+        fprintf(stderr, "ABORT: Could not switch %s to version %ld: %s\n", name, version, strerror(errno));
+        unlink(tmplink);
+        return(255);
+    }
+
+    printf("Published %s as version %ld of %s\n", srcimage, version, name);
+
+    retire_versions(versions, version);
+
+    return(0);
+}
@@ -0,0 +1,597 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+
+#include "config.h"
+#include "sha256.h"
+#include "util.h"
+
+
+#ifndef LOCALSTATEDIR
+#define LOCALSTATEDIR "/var/"
+#endif
+
+#define STORE_CHUNK_SIZE (128 * 1024)
+#define STORE_HOLE "-"
+
+
+// Set of chunk hashes with a reference count for each
+struct chunk_set {
+    unsigned char *keys;
+    long *counts;
+    long slots;
+    long used;
+};
+
+
+static char *store_dir;
+
+
+static int hex2hash(char *hex, unsigned char *hash) {
+    int i;
+
+    for ( i = 0; i < SHA256_DIGEST_LENGTH; i++ ) {
+        unsigned int byte;
+        if ( sscanf(hex + i * 2, "%2x", &byte) != 1 ) {
+            return(-1);
+        }
+        hash[i] = byte;
+    }
+
+    return(0);
+}
+
+
+static void chunk_set_init(struct chunk_set *set) {
+    set->slots = 4096;
+    set->used = 0;
+    set->keys = (unsigned char *) calloc(set->slots, SHA256_DIGEST_LENGTH);
+    set->counts = (long *) calloc(set->slots, sizeof(long));
+}
+
+
+static long *chunk_set_slot(struct chunk_set *set, unsigned char *hash, int insert) {
+    long slot;
+
+    if ( insert && set->used * 2 >= set->slots ) {
+        struct chunk_set grown;
+        long i;
+
+        grown.slots = set->slots * 2;
+        grown.used = 0;
+        grown.keys = (unsigned char *) calloc(grown.slots, SHA256_DIGEST_LENGTH);
+        grown.counts = (long *) calloc(grown.slots, sizeof(long));
+        for ( i = 0; i < set->slots; i++ ) {
+            if ( set->counts[i] > 0 ) {
+                *chunk_set_slot(&grown, set->keys + i * SHA256_DIGEST_LENGTH, 1) = set->counts[i];
+            }
+        }
+        free(set->keys);
+        free(set->counts);
+        *set = grown;
+    }
+
+    memcpy(&slot, hash, sizeof(slot));
+    for ( slot = ( slot & 0x7fffffffffffffffL ) % set->slots; set->counts[slot] > 0; slot = ( slot + 1 ) % set->slots ) {
+        if ( memcmp(set->keys + slot * SHA256_DIGEST_LENGTH, hash, SHA256_DIGEST_LENGTH) == 0 ) {
+            return(&set->counts[slot]);
+        }
+    }
+
+    if ( ! insert ) {
+        return(NULL);
+    }
+
+    memcpy(set->keys + slot * SHA256_DIGEST_LENGTH, hash, SHA256_DIGEST_LENGTH);
+    set->used++;
+
+    return(&set->counts[slot]);
+}
+
+
+static char *chunk_path(char *hex) {
+    char *path = (char *) malloc(strlen(store_dir) + 80);
+
+    snprintf(path, strlen(store_dir) + 80, "%s/chunks/%.2s/%s", store_dir, hex, hex);
+
+    return(path);
+}
+
+
+static char *manifest_path(char *name) {
+    if ( strchr(name, '/') != NULL || name[0] == '.' ) {
+        fprintf(stderr, "ERROR: Invalid store image name: %s\n", name);
+        return(NULL);
+    }
+
+    return(joinpath(joinpath(store_dir, "images"), name));
+}
+
+
+static int store_lock(int operation) {
+    int lock_fd;
+
+    if ( s_mkpath(joinpath(store_dir, "chunks"), 0755) < 0 || s_mkpath(joinpath(store_dir, "images"), 0755) < 0 || s_mkpath(joinpath(store_dir, "cache"), 0755) < 0 ) {
+        return(-1);
+    }
+
+    if ( ( lock_fd = open(joinpath(store_dir, "lock"), O_CREAT | O_RDWR, 0644) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open store lock: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    // Chunks are written before the manifest that references them, so gc
+    // must never run while an image is being added
+    if ( flock(lock_fd, operation) < 0 ) {
+        fprintf(stderr, "ERROR: Could not lock image store: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    return(lock_fd);
+}
+
+
+static int file_put_atomic(char *path, unsigned char *data, size_t len) {
+    char *tmp = strjoin(path, ".XXXXXX");
+    int fd;
+
+    if ( ( fd = mkstemp(tmp) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not create %s: %s\n", tmp, strerror(errno));
+        return(-1);
+    }
+
+    if ( write(fd, data, len) != (ssize_t)len || fchmod(fd, 0644) < 0 || close(fd) < 0 || rename(tmp, path) < 0 ) {
+        fprintf(stderr, "ERROR: Could not write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+static int store_add(char *image, char *name) {
+    unsigned char *buff = (unsigned char *) malloc(STORE_CHUNK_SIZE);
+    unsigned char *zero = (unsigned char *) calloc(1, STORE_CHUNK_SIZE);
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    char *manifest;
+    char *path;
+    struct stat filestat;
+    long long offset;
+    long long stored = 0;
+    FILE *out;
+    int image_fd;
+
+    if ( ( path = manifest_path(name) ) == NULL ) {
+        return(-1);
+    }
+
+    if ( ( image_fd = open(image, O_RDONLY) ) < 0 || fstat(image_fd, &filestat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", image, strerror(errno));
+        return(-1);
+    }
+
+    manifest = strjoin(path, ".new");
+    if ( ( out = fopen(manifest, "w") ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not write %s: %s\n", manifest, strerror(errno));
+        return(-1);
+    }
+
+    fprintf(out, "singularity-store 1 %d %lld\n", STORE_CHUNK_SIZE, (long long)filestat.st_size);
+
+    for ( offset = 0; offset < filestat.st_size; offset += STORE_CHUNK_SIZE ) {
+        size_t len = ( filestat.st_size - offset ) < STORE_CHUNK_SIZE ? ( filestat.st_size - offset ) : STORE_CHUNK_SIZE;
+        off_t data = lseek(image_fd, offset, SEEK_DATA);
+        struct sha256_ctx ctx;
+        char *chunk;
+
+        if ( ( data < 0 && errno == ENXIO ) || data >= offset + (off_t)len ) {
+            fprintf(out, "%s\n", STORE_HOLE);
+            continue;
+        }
+
+        if ( pread(image_fd, buff, len, offset) != (ssize_t)len ) {
+            fprintf(stderr, "ERROR: Could not read image %s: %s\n", image, strerror(errno));
+            fclose(out);
+            unlink(manifest);
+            return(-1);
+        }
+
+        if ( memcmp(buff, zero, len) == 0 ) {
+            fprintf(out, "%s\n", STORE_HOLE);
+            continue;
+        }
+
+        sha256_init(&ctx);
+        sha256_update(&ctx, buff, len);
+        sha256_final(&ctx, hash);
+        sha256_hex(hash, hex);
+        fprintf(out, "%s\n", hex);
+
+        chunk = chunk_path(hex);
+        if ( is_file(chunk) < 0 ) {
+            if ( s_mkpath(dirname(strdupa(chunk)), 0755) < 0 || file_put_atomic(chunk, buff, len) < 0 ) {
+                fclose(out);
+                unlink(manifest);
+                return(-1);
+            }
+            stored += len;
+        }
+        free(chunk);
+    }
+
+    close(image_fd);
+
+    if ( fclose(out) != 0 || rename(manifest, path) < 0 ) {
+        fprintf(stderr, "ERROR: Could not write manifest %s: %s\n", path, strerror(errno));
+        unlink(manifest);
+        return(-1);
+    }
+
+    printf("Added %s: %lld new bytes stored for a %lld byte image\n", name, stored, (long long)filestat.st_size);
+
+    free(buff);
+    free(zero);
+
+    return(0);
+}
+
+
+static int store_get(char *name, char *output) {
+    unsigned char *buff = (unsigned char *) malloc(STORE_CHUNK_SIZE);
+    char line[256];
+    char *path;
+    long long size;
+    long long offset = 0;
+    int chunk_size;
+    FILE *manifest;
+    int out_fd;
+
+    if ( ( path = manifest_path(name) ) == NULL ) {
+        return(-1);
+    }
+
+    if ( ( manifest = fopen(path, "r") ) == NULL ) {
+        fprintf(stderr, "ERROR: No such image in store: %s\n", name);
+        return(-1);
+    }
+
+    if ( fgets(line, sizeof(line), manifest) == NULL || sscanf(line, "singularity-store 1 %d %lld", &chunk_size, &size) != 2 || chunk_size != STORE_CHUNK_SIZE ) {
+        fprintf(stderr, "ERROR: Unrecognized manifest format: %s\n", path);
+        return(-1);
+    }
+
+    if ( ( out_fd = open(output, O_CREAT | O_TRUNC | O_WRONLY, 0644) ) < 0 || ftruncate(out_fd, size) < 0 ) {
+        fprintf(stderr, "ERROR: Could not create %s: %s\n", output, strerror(errno));
+        return(-1);
+    }
+
+    while ( fgets(line, sizeof(line), manifest) != NULL ) {
+        size_t len = ( size - offset ) < STORE_CHUNK_SIZE ? ( size - offset ) : STORE_CHUNK_SIZE;
+        char *chunk;
+        int chunk_fd;
+
+        line[strcspn(line, "\n")] = '\0';
+
+        if ( strcmp(line, STORE_HOLE) != 0 ) {
+            chunk = chunk_path(line);
+            if ( ( chunk_fd = open(chunk, O_RDONLY) ) < 0 || read(chunk_fd, buff, len) != (ssize_t)len ) {
+                fprintf(stderr, "ERROR: Store chunk is missing or short: %s\n", chunk);
+                close(out_fd);
+                unlink(output);
+                return(-1);
+            }
+            close(chunk_fd);
+            free(chunk);
+
+            if ( pwrite(out_fd, buff, len, offset) != (ssize_t)len ) {
+                fprintf(stderr, "ERROR: Could not write %s: %s\n", output, strerror(errno));
+                close(out_fd);
+                unlink(output);
+                return(-1);
+            }
+        }
+
+        offset += STORE_CHUNK_SIZE;
+    }
+
+    fclose(manifest);
+    free(buff);
+
+    if ( close(out_fd) < 0 ) {
+        fprintf(stderr, "ERROR: Could not write %s: %s\n", output, strerror(errno));
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+// Count the references to every chunk from every manifest in the store
+static int store_refcount(struct chunk_set *set) {
+    char *images = joinpath(store_dir, "images");
+    struct dirent *entry;
+    DIR *dir;
+
+    chunk_set_init(set);
+
+    if ( ( dir = opendir(images) ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", images, strerror(errno));
+        return(-1);
+    }
+
+    while ( ( entry = readdir(dir) ) != NULL ) {
+        unsigned char hash[SHA256_DIGEST_LENGTH];
+        char line[256];
+        FILE *manifest;
+
+        if ( entry->d_name[0] == '.' || strstr(entry->d_name, ".new") != NULL ) {
+            continue;
+        }
+
+        if ( ( manifest = fopen(joinpath(images, entry->d_name), "r") ) == NULL ) {
+            continue;
+        }
+
+        // Skip the header
+        if ( fgets(line, sizeof(line), manifest) == NULL ) {
+            fclose(manifest);
+            continue;
+        }
+
+        while ( fgets(line, sizeof(line), manifest) != NULL ) {
+            if ( hex2hash(line, hash) == 0 ) {
+                *chunk_set_slot(set, hash, 1) += 1;
+            }
+        }
+        fclose(manifest);
+    }
+
+    closedir(dir);
+
+    return(0);
+}
+
+
+static int store_gc(void) {
+    struct chunk_set set;
+    char *chunks = joinpath(store_dir, "chunks");
+    long long freed = 0;
+    long removed = 0;
+    int i;
+
+    if ( store_refcount(&set) < 0 ) {
+        return(-1);
+    }
+
+    for ( i = 0; i < 256; i++ ) {
+        char sub[3];
+        char *subdir;
+        struct dirent *entry;
+        DIR *dir;
+
+        snprintf(sub, sizeof(sub), "%02x", i);
+        subdir = joinpath(chunks, sub);
+        if ( ( dir = opendir(subdir) ) == NULL ) {
+            continue;
+        }
+
+        while ( ( entry = readdir(dir) ) != NULL ) {
+            unsigned char hash[SHA256_DIGEST_LENGTH];
+            struct stat filestat;
+            char *path;
+
+            if ( entry->d_name[0] == '.' ) {
+                continue;
+            }
+
+            path = joinpath(subdir, entry->d_name);
+
+            // Unreferenced chunks and partial writes left by an interrupted add
+            if ( strlen(entry->d_name) != SHA256_DIGEST_LENGTH * 2 || hex2hash(entry->d_name, hash) < 0 || chunk_set_slot(&set, hash, 0) == NULL ) {
+                if ( lstat(path, &filestat) == 0 && unlink(path) == 0 ) {
+                    freed += filestat.st_size;
+                    removed++;
+                }
+            }
+            free(path);
+        }
+
+        closedir(dir);
+    }
+
+    printf("Removed %ld unreferenced chunks (%lld bytes)\n", removed, freed);
+
+    return(0);
+}
+
+
+static int store_list(void) {
+    struct chunk_set set;
+    char *images = joinpath(store_dir, "images");
+    struct dirent *entry;
+    DIR *dir;
+
+    if ( store_refcount(&set) < 0 ) {
+        return(-1);
+    }
+
+    if ( ( dir = opendir(images) ) == NULL ) {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", images, strerror(errno));
+        return(-1);
+    }
+
+    printf("%-30s %14s %10s %10s\n", "NAME", "SIZE", "CHUNKS", "EXCLUSIVE");
+
+    while ( ( entry = readdir(dir) ) != NULL ) {
+        unsigned char hash[SHA256_DIGEST_LENGTH];
+        char line[256];
+        long long size = 0;
+        long chunks = 0;
+        long exclusive = 0;
+        int chunk_size;
+        FILE *manifest;
+
+        if ( entry->d_name[0] == '.' || strstr(entry->d_name, ".new") != NULL ) {
+            continue;
+        }
+
+        if ( ( manifest = fopen(joinpath(images, entry->d_name), "r") ) == NULL ) {
+            continue;
+        }
+
+        if ( fgets(line, sizeof(line), manifest) == NULL || sscanf(line, "singularity-store 1 %d %lld", &chunk_size, &size) != 2 ) {
+            fclose(manifest);
+            continue;
+        }
+
+        // Chunks referenced only once are what removing this image frees
+        while ( fgets(line, sizeof(line), manifest) != NULL ) {
+            if ( hex2hash(line, hash) == 0 ) {
+                long *count = chunk_set_slot(&set, hash, 0);
+                chunks++;
+                if ( count != NULL && *count == 1 ) {
+                    exclusive++;
+                }
+            }
+        }
+        fclose(manifest);
+
+        printf("%-30s %14lld %10ld %9lldK\n", entry->d_name, size, chunks, (long long)exclusive * STORE_CHUNK_SIZE / 1024);
+    }
+
+    closedir(dir);
+
+    return(0);
+}
+
+
+// Reassemble an image into the store cache for launching, reusing a
+// previous checkout as long as the manifest has not been replaced since
+static int store_path(char *name) {
+    struct stat manifest_stat;
+    struct stat cache_stat;
+    char *path;
+    char *cache;
+    char *tmp;
+
+    if ( ( path = manifest_path(name) ) == NULL ) {
+        return(-1);
+    }
+
+    if ( stat(path, &manifest_stat) < 0 ) {
+        fprintf(stderr, "ERROR: No such image in store: %s\n", name);
+        return(-1);
+    }
+
+    cache = strjoin(joinpath(joinpath(store_dir, "cache"), name), ".img");
+
+    // A checkout from the same timestamp as the manifest may predate it
+    if ( stat(cache, &cache_stat) < 0 || cache_stat.st_mtim.tv_sec < manifest_stat.st_mtim.tv_sec ||
+            ( cache_stat.st_mtim.tv_sec == manifest_stat.st_mtim.tv_sec && cache_stat.st_mtim.tv_nsec <= manifest_stat.st_mtim.tv_nsec ) ) {
+        int tmp_fd;
+
+        // Concurrent checkouts each write their own file, the last rename
+        // wins and both are complete
+        tmp = strjoin(cache, ".XXXXXX");
+        if ( ( tmp_fd = mkstemp(tmp) ) < 0 || fchmod(tmp_fd, 0644) < 0 ) {
+            fprintf(stderr, "ERROR: Could not create %s: %s\n", tmp, strerror(errno));
+            return(-1);
+        }
+        close(tmp_fd);
+        if ( store_get(name, tmp) < 0 || rename(tmp, cache) < 0 ) {
+            unlink(tmp);
+            return(-1);
+        }
+    }
+
+    printf("%s\n", cache);
+
+    return(0);
+}
+
+
+int main(int argc, char ** argv) {
+    char *command;
+    int lock_fd;
+    int retval = -1;
+
+    if ( argv[1] == NULL ) {
+        fprintf(stderr, "USAGE: %s [add|get|rm|gc|list|path] (arguments)\n", argv[0]);
+        return(1);
+    }
+
+    command = argv[1];
+
+    if ( getenv("SINGULARITY_STORE") != NULL ) {
+        store_dir = strdup(getenv("SINGULARITY_STORE"));
+    } else {
+        store_dir = joinpath(LOCALSTATEDIR, "singularity/store");
+    }
+
+    if ( ( lock_fd = store_lock(strcmp(command, "gc") == 0 ? LOCK_EX : LOCK_SH) ) < 0 ) {
+        return(255);
+    }
+
+    if ( strcmp(command, "add") == 0 && argc == 4 ) {
+        retval = store_add(argv[2], argv[3]);
+    } else if ( strcmp(command, "get") == 0 && argc == 4 ) {
+        retval = store_get(argv[2], argv[3]);
+    } else if ( strcmp(command, "rm") == 0 && argc == 3 ) {
+        char *path = manifest_path(argv[2]);
+        if ( path != NULL && ( retval = unlink(path) ) < 0 ) {
+            fprintf(stderr, "ERROR: No such image in store: %s\n", argv[2]);
+        }
+        if ( retval == 0 ) {
+            unlink(strjoin(joinpath(joinpath(store_dir, "cache"), argv[2]), ".img"));
+        }
+    } else if ( strcmp(command, "gc") == 0 && argc == 2 ) {
+        retval = store_gc();
+    } else if ( strcmp(command, "list") == 0 && argc == 2 ) {
+        retval = store_list();
+    } else if ( strcmp(command, "path") == 0 && argc == 3 ) {
+        retval = store_path(argv[2]);
+    } else {
+        fprintf(stderr, "USAGE: %s [add|get|rm|gc|list|path] (arguments)\n", argv[0]);
+        return(1);
+    }
+
+    close(lock_fd);
+
+    if ( retval < 0 ) {
+        return(255);
+    }
+
+    return(0);
+}
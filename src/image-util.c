@@ -0,0 +1,572 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include "config.h"
+#include "image-util.h"
+#include "util.h"
+
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_SUPER_MAGIC 0xEF53
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x80
+
+#define PUNCH_BLOCK_SIZE 4096
+#define PUNCH_BUFFER_SIZE (1024 * 1024)
+
+
+static int image_check(char *path) {
+    char *fsck_argv[] = { "e2fsck", "-f", "-p", path, NULL };
+    int retval;
+
+    // e2fsck returns 1 when it has corrected minor problems
+    retval = s_spawn(fsck_argv);
+    if ( retval != 0 && retval != 1 ) {
+        fprintf(stderr, "ERROR: File system check failed on %s\n", path);
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+int image_create(char *path, long long size, int preallocate) {
+    int image_fd;
+
+    if ( ( image_fd = open(path, O_CREAT | O_RDWR, 0644) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not create image %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+
+    // Drop any previous contents so the new image starts out fully sparse
+    if ( ftruncate(image_fd, 0) < 0 || ftruncate(image_fd, size) < 0 ) {
+        fprintf(stderr, "ERROR: Could not size image %s: %s\n", path, strerror(errno));
+        close(image_fd);
+        return(-1);
+    }
+
+    if ( preallocate > 0 ) {
+        if ( fallocate(image_fd, 0, 0, size) < 0 ) {
+            if ( errno != EOPNOTSUPP ) {
+                fprintf(stderr, "ERROR: Could not allocate image %s: %s\n", path, strerror(errno));
+                close(image_fd);
+                return(-1);
+            }
+            fprintf(stderr, "WARNING: Preallocation not supported here, image will be sparse\n");
+        }
+    }
+
+    close(image_fd);
+
+    return(0);
+}
+
+
+// mke2fs takes inode change and access times from the files it copies in,
+// which no build can reproduce, so they are set to the timestamp after the
+// fact. A freshly populated file system has its inodes in use from the
+// first non-reserved one on, without gaps.
+static int image_fix_times(char *path, long long timestamp) {
+    unsigned char sb[1024];
+    uint32_t inodes_count;
+    uint32_t free_inodes;
+    uint32_t first_ino;
+    uint32_t ino;
+    int image_fd;
+    int pipefd[2];
+    int status;
+    pid_t pid;
+    FILE *cmds;
+
+    if ( ( image_fd = open(path, O_RDONLY) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+    if ( pread(image_fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET) != sizeof(sb) ) {
+        fprintf(stderr, "ERROR: Could not read file system superblock: %s\n", strerror(errno));
+        close(image_fd);
+        return(-1);
+    }
+    close(image_fd);
+
+    memcpy(&inodes_count, sb + 0x00, sizeof(inodes_count));
+    memcpy(&free_inodes, sb + 0x10, sizeof(free_inodes));
+    memcpy(&first_ino, sb + 0x54, sizeof(first_ino));
+
+    if ( pipe(pipefd) < 0 ) {
+        fprintf(stderr, "ERROR: Could not create pipe: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    pid = fork();
+
+    if ( pid == 0 ) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(pipefd[0], 0);
+        dup2(devnull, 1);
+        dup2(devnull, 2);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        execlp("debugfs", "debugfs", "-w", "-f", "-", path, NULL);
+        _exit(255);
+    } else if ( pid < 0 ) {
+        fprintf(stderr, "ERROR: Could not fork child process: %s\n", strerror(errno));
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return(-1);
+    }
+
+    close(pipefd[0]);
+    cmds = fdopen(pipefd[1], "w");
+    // The root directory is the one reserved inode taken from the tree
+    fprintf(cmds, "sif <2> ctime @%lld\nsif <2> atime @%lld\n", timestamp, timestamp);
+    for ( ino = first_ino; ino <= inodes_count - free_inodes; ino++ ) {
+        fprintf(cmds, "sif <%u> ctime @%lld\nsif <%u> atime @%lld\n", ino, timestamp, ino, timestamp);
+    }
+    fclose(cmds);
+
+    if ( waitpid(pid, &status, 0) < 0 || ! WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+        fprintf(stderr, "ERROR: Could not set inode times in %s\n", path);
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+int image_format(char *path, struct image_format_opts *opts) {
+    char *argv[20];
+    char *features;
+    char *extended;
+    char timestamp[32];
+    int retval;
+    int i = 0;
+
+    // Container images are mostly read and rarely crash mid-write, so the
+    // journal is optional. Lazy init keeps mkfs from writing zeros into
+    // the sparse file and flex_bg packs metadata for fewer seeks.
+    if ( opts->journal > 0 ) {
+        features = strdup("flex_bg,has_journal");
+    } else {
+        features = strdup("flex_bg,^has_journal");
+    }
+
+    argv[i++] = strdup("mkfs.ext4");
+    argv[i++] = strdup("-q");
+    argv[i++] = strdup("-F");
+    argv[i++] = strdup("-m");
+    argv[i++] = strdup("0");
+    argv[i++] = strdup("-O");
+    argv[i++] = features;
+    if ( opts->inode_count > 0 ) {
+        char *inode_count = (char *) malloc(32);
+        snprintf(inode_count, 32, "%lld", opts->inode_count);
+        argv[i++] = strdup("-N");
+        argv[i++] = inode_count;
+    } else {
+        argv[i++] = strdup("-i");
+        argv[i++] = int2str(opts->inode_ratio);
+    }
+    // A fixed UUID also seeds the directory hashes, which are random
+    // otherwise, so the same tree is laid out the same way every time
+    if ( opts->uuid != NULL ) {
+        argv[i++] = strdup("-U");
+        argv[i++] = opts->uuid;
+        extended = strjoin("lazy_itable_init=1,lazy_journal_init=1,nodiscard,hash_seed=", opts->uuid);
+    } else {
+        extended = strdup("lazy_itable_init=1,lazy_journal_init=1,nodiscard");
+    }
+    argv[i++] = strdup("-E");
+    argv[i++] = extended;
+    if ( opts->populate != NULL ) {
+        argv[i++] = strdup("-d");
+        argv[i++] = opts->populate;
+    }
+    argv[i++] = path;
+    argv[i++] = NULL;
+
+    // Stamps the superblock and the inodes mke2fs creates itself, and the
+    // superblock again when debugfs writes it
+    if ( opts->timestamp > 0 ) {
+        snprintf(timestamp, sizeof(timestamp), "%lld", opts->timestamp);
+        setenv("E2FSPROGS_FAKE_TIME", timestamp, 1);
+    }
+
+    if ( ( retval = s_spawn(argv) ) != 0 ) {
+        fprintf(stderr, "ERROR: Failed to format image %s\n", path);
+        retval = -1;
+    } else if ( opts->timestamp > 0 && opts->populate != NULL ) {
+        retval = image_fix_times(path, opts->timestamp);
+    }
+
+    if ( opts->timestamp > 0 ) {
+        unsetenv("E2FSPROGS_FAKE_TIME");
+    }
+
+    return(retval);
+}
+
+
+// Size an image for a known amount of content: room for the data plus ~10%
+// for metadata and a little slack, rounded to whole MB. Also picks an inode
+// count with headroom for the entries.
+long long image_size_for_content(long long bytes, long long entries, struct image_format_opts *opts) {
+    long long size;
+
+    opts->inode_count = entries + entries / 4 + 1024;
+    size = bytes + bytes / 10 + opts->inode_count * 256 + 32 * 1024 * 1024;
+
+    return(( size + 1024 * 1024 - 1 ) / ( 1024 * 1024 ) * ( 1024 * 1024 ));
+}
+
+
+// mke2fs can populate directly from a tarball starting with e2fsprogs 1.47.1
+int image_format_can_populate_tar(void) {
+    FILE *mkfs;
+    char version[256];
+    int major = 0;
+    int minor = 0;
+    int patch = 0;
+
+    if ( ( mkfs = popen("mkfs.ext4 -V 2>&1", "r") ) == NULL ) {
+        return(0);
+    }
+
+    if ( fgets(version, sizeof(version), mkfs) != NULL ) {
+        sscanf(version, "mke2fs %d.%d.%d", &major, &minor, &patch);
+    }
+
+    pclose(mkfs);
+
+    if ( major > 1 || ( major == 1 && minor > 47 ) || ( major == 1 && minor == 47 && patch >= 1 ) ) {
+        return(1);
+    }
+
+    return(0);
+}
+
+
+int image_expand(char *path, long long size) {
+    struct stat filestat;
+    char *resize_argv[] = { "resize2fs", "-p", path, NULL };
+    int image_fd;
+
+    if ( ( image_fd = open(path, O_RDWR) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+
+    // Running containers hold a shared lock on the image, and the file
+    // system can only be resized safely while nothing has it mounted
+    if ( flock(image_fd, LOCK_EX | LOCK_NB) < 0 ) {
+        fprintf(stderr, "ERROR: Image is in use by another process: %s\n", path);
+        close(image_fd);
+        return(-1);
+    }
+
+    if ( fstat(image_fd, &filestat) < 0 ) {
+        fprintf(stderr, "ERROR: Could not stat image %s: %s\n", path, strerror(errno));
+        close(image_fd);
+        return(-1);
+    }
+
+    if ( ftruncate(image_fd, filestat.st_size + size) < 0 ) {
+        fprintf(stderr, "ERROR: Could not grow image %s: %s\n", path, strerror(errno));
+        close(image_fd);
+        return(-1);
+    }
+
+    // A failed check or resize leaves the file system as it was, so the
+    // image goes back to its old size with it
+    if ( image_check(path) < 0 ) {
+        if ( ftruncate(image_fd, filestat.st_size) < 0 ) {
+            fprintf(stderr, "WARNING: Could not restore size of %s: %s\n", path, strerror(errno));
+        }
+        close(image_fd);
+        return(-1);
+    }
+
+    if ( s_spawn(resize_argv) != 0 ) {
+        fprintf(stderr, "ERROR: Failed to resize file system in %s\n", path);
+        if ( ftruncate(image_fd, filestat.st_size) < 0 ) {
+            fprintf(stderr, "WARNING: Could not restore size of %s: %s\n", path, strerror(errno));
+        }
+        close(image_fd);
+        return(-1);
+    }
+
+    close(image_fd);
+
+    return(0);
+}
+
+
+long long image_allocated(int image_fd) {
+    struct stat filestat;
+
+    if ( fstat(image_fd, &filestat) < 0 ) {
+        return(-1);
+    }
+
+    return((long long)filestat.st_blocks * 512);
+}
+
+
+long long image_fs_size(int image_fd) {
+    unsigned char sb[1024];
+    uint32_t blocks_lo;
+    uint32_t blocks_hi = 0;
+    uint32_t log_block_size;
+    uint32_t incompat;
+    uint16_t magic;
+
+    if ( pread(image_fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET) != sizeof(sb) ) {
+        fprintf(stderr, "ERROR: Could not read file system superblock: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    memcpy(&magic, sb + 0x38, sizeof(magic));
+    if ( magic != EXT4_SUPER_MAGIC ) {
+        fprintf(stderr, "ERROR: Image does not contain an ext file system\n");
+        return(-1);
+    }
+
+    memcpy(&blocks_lo, sb + 0x04, sizeof(blocks_lo));
+    memcpy(&log_block_size, sb + 0x18, sizeof(log_block_size));
+    memcpy(&incompat, sb + 0x60, sizeof(incompat));
+    if ( incompat & EXT4_FEATURE_INCOMPAT_64BIT ) {
+        memcpy(&blocks_hi, sb + 0x150, sizeof(blocks_hi));
+    }
+
+    return((((long long)blocks_hi << 32) | blocks_lo) * (1024LL << log_block_size));
+}
+
+
+int image_punch_zeros(int image_fd) {
+    char *buff;
+    char zero[PUNCH_BLOCK_SIZE] = {0};
+    off_t end;
+    off_t data;
+    off_t hole;
+    off_t run_start = -1;
+
+    if ( ( end = lseek(image_fd, 0, SEEK_END) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not seek in image: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    buff = (char *) malloc(PUNCH_BUFFER_SIZE);
+
+    // Only walk the allocated extents, holes are already free
+    for ( data = lseek(image_fd, 0, SEEK_DATA); data >= 0 && data < end; data = lseek(image_fd, hole, SEEK_DATA) ) {
+        off_t pos;
+
+        if ( ( hole = lseek(image_fd, data, SEEK_HOLE) ) < 0 ) {
+            break;
+        }
+
+        for ( pos = data; pos < hole; ) {
+            ssize_t len;
+            ssize_t i;
+
+            len = pread(image_fd, buff, (hole - pos) < PUNCH_BUFFER_SIZE ? (hole - pos) : PUNCH_BUFFER_SIZE, pos);
+            if ( len <= 0 ) {
+                fprintf(stderr, "ERROR: Could not read image: %s\n", strerror(errno));
+                free(buff);
+                return(-1);
+            }
+
+            for ( i = 0; i < len; i += PUNCH_BLOCK_SIZE ) {
+                ssize_t blen = ( len - i ) < PUNCH_BLOCK_SIZE ? ( len - i ) : PUNCH_BLOCK_SIZE;
+
+                if ( memcmp(buff + i, zero, blen) == 0 ) {
+                    if ( run_start < 0 ) {
+                        run_start = pos + i;
+                    }
+                } else if ( run_start >= 0 ) {
+                    if ( fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, run_start, pos + i - run_start) < 0 ) {
+                        fprintf(stderr, "ERROR: Could not punch hole in image: %s\n", strerror(errno));
+                        free(buff);
+                        return(-1);
+                    }
+                    run_start = -1;
+                }
+            }
+            pos += len;
+        }
+
+        if ( run_start >= 0 ) {
+            if ( fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, run_start, hole - run_start) < 0 ) {
+                fprintf(stderr, "ERROR: Could not punch hole in image: %s\n", strerror(errno));
+                free(buff);
+                return(-1);
+            }
+            run_start = -1;
+        }
+    }
+
+    free(buff);
+
+    return(0);
+}
+
+
+int image_shrink(char *path, int image_fd) {
+    char *resize_argv[] = { "resize2fs", "-M", "-p", path, NULL };
+    long long fs_size;
+
+    if ( image_check(path) < 0 ) {
+        return(-1);
+    }
+
+    if ( s_spawn(resize_argv) != 0 ) {
+        fprintf(stderr, "ERROR: Failed to shrink file system in %s\n", path);
+        return(-1);
+    }
+
+    if ( ( fs_size = image_fs_size(image_fd) ) < 0 ) {
+        return(-1);
+    }
+
+    if ( ftruncate(image_fd, fs_size) < 0 ) {
+        fprintf(stderr, "ERROR: Could not truncate image %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+// Copy length bytes of the allocated extents of src at src_offset to
+// dst_offset in dst, leaving holes in dst wherever src has them
+int image_copy_data(int src_fd, long long src_offset, int dst_fd, long long dst_offset, long long length) {
+    char *buff;
+    off_t data;
+    off_t hole;
+
+    buff = (char *) malloc(PUNCH_BUFFER_SIZE);
+
+    length += src_offset;
+
+    for ( data = lseek(src_fd, src_offset, SEEK_DATA); data >= 0 && data < length; data = lseek(src_fd, hole, SEEK_DATA) ) {
+        off_t pos;
+
+        if ( ( hole = lseek(src_fd, data, SEEK_HOLE) ) < 0 ) {
+            break;
+        }
+        if ( hole > length ) {
+            hole = length;
+        }
+
+        for ( pos = data; pos < hole; ) {
+            ssize_t len = pread(src_fd, buff, (hole - pos) < PUNCH_BUFFER_SIZE ? (hole - pos) : PUNCH_BUFFER_SIZE, pos);
+            if ( len <= 0 || pwrite(dst_fd, buff, len, pos - src_offset + dst_offset) != len ) {
+                fprintf(stderr, "ERROR: Could not copy image data: %s\n", strerror(errno));
+                free(buff);
+                return(-1);
+            }
+            pos += len;
+        }
+    }
+
+    free(buff);
+
+    return(0);
+}
+
+
+// Make dst a copy of the first length bytes of src as cheaply as the file
+// systems allow: share the extents (reflink), let the kernel copy the data
+// segments (which some file systems also turn into reflinks or server side
+// copies), or fall back to copying the data segments ourselves. Returns the
+// method used or NULL on failure.
+char *image_clone(int src_fd, int dst_fd, long long length) {
+#ifdef HAVE_COPY_FILE_RANGE
+    off_t data;
+    off_t hole;
+    int copied = 0;
+#endif
+
+    if ( ftruncate(dst_fd, length) < 0 ) {
+        fprintf(stderr, "ERROR: Could not size image copy: %s\n", strerror(errno));
+        return(NULL);
+    }
+
+#ifdef FICLONE
+    if ( ioctl(dst_fd, FICLONE, src_fd) == 0 ) {
+        return("reflink");
+    }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    for ( data = lseek(src_fd, 0, SEEK_DATA); data >= 0 && data < length; data = lseek(src_fd, hole, SEEK_DATA) ) {
+        loff_t in;
+        loff_t out;
+
+        if ( ( hole = lseek(src_fd, data, SEEK_HOLE) ) < 0 ) {
+            break;
+        }
+        if ( hole > length ) {
+            hole = length;
+        }
+
+        for ( in = out = data; in < hole; ) {
+            ssize_t len = copy_file_range(src_fd, &in, dst_fd, &out, hole - in, 0);
+
+            if ( len == 0 ) {
+                break;
+            }
+            if ( len < 0 ) {
+                // Not supported between these files, nothing copied yet
+                if ( copied == 0 && ( errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP ) ) {
+                    goto fallback;
+                }
+                fprintf(stderr, "ERROR: Could not copy image data: %s\n", strerror(errno));
+                return(NULL);
+            }
+            copied = 1;
+        }
+    }
+
+    return("copy_file_range");
+
+fallback:
+#endif
+    if ( image_copy_data(src_fd, 0, dst_fd, 0, length) < 0 ) {
+        return(NULL);
+    }
+
+    return("sparse copy");
+}
@@ -0,0 +1,41 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+
+struct image_format_opts {
+    int journal;
+    int inode_ratio;
+    long long inode_count;
+    char *populate;
+    char *uuid;
+    long long timestamp;
+};
+
+int image_create(char *path, long long size, int preallocate);
+int image_format(char *path, struct image_format_opts *opts);
+long long image_size_for_content(long long bytes, long long entries, struct image_format_opts *opts);
+int image_expand(char *path, long long size);
+long long image_allocated(int image_fd);
+long long image_fs_size(int image_fd);
+int image_punch_zeros(int image_fd);
+int image_shrink(char *path, int image_fd);
+int image_format_can_populate_tar(void);
+int image_copy_data(int src_fd, long long src_offset, int dst_fd, long long dst_offset, long long length);
+char *image_clone(int src_fd, int dst_fd, long long length);
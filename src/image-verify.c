@@ -0,0 +1,86 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "image-digest.h"
+#include "image-header.h"
+#include "sha256.h"
+#include "util.h"
+
+
+int main(int argc, char ** argv) {
+    struct image_header header;
+    unsigned char root[SHA256_DIGEST_LENGTH];
+    char *containerimage;
+    int containerimage_fd;
+    int retval;
+
+    if ( argv[1] == NULL ) {
+        fprintf(stderr, "USAGE: %s [singularity container image]\n", argv[0]);
+        return(1);
+    }
+
+    containerimage = strdup(argv[1]);
+
+    if ( is_file(containerimage) < 0 ) {
+        fprintf(stderr, "ABORT: Container image not found: %s\n", containerimage);
+        return(1);
+    }
+
+    if ( ( containerimage_fd = open(containerimage, O_RDONLY) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open image %s: %s\n", containerimage, strerror(errno));
+        return(255);
+    }
+
+    retval = image_digest_verify(containerimage, containerimage_fd, NULL);
+
+    // Wrapped images carry the file system hash in their header
+    if ( retval == 1 && image_header_read(containerimage_fd, &header, NULL, NULL) == 0 ) {
+        if ( image_digest(containerimage_fd, header.fs_offset, header.fs_size, root) < 0 ) {
+            fprintf(stderr, "ABORT: Could not hash image: %s\n", containerimage);
+            return(255);
+        }
+        retval = ( memcmp(root, header.fs_hash, SHA256_DIGEST_LENGTH) == 0 ) ? 0 : -1;
+    }
+    close(containerimage_fd);
+
+    if ( retval == 1 ) {
+        fprintf(stderr, "ABORT: Image has no digest, run 'singularity image sign' first\n");
+        return(1);
+    } else if ( retval < 0 ) {
+        fprintf(stderr, "ABORT: Image verification failed: %s\n", containerimage);
+        return(255);
+    }
+
+    printf("Image verified: %s\n", containerimage);
+
+    return(0);
+}
@@ -0,0 +1,195 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+#include <libgen.h>
+
+#include "config.h"
+#include "image-version.h"
+#include "util.h"
+
+
+// Hold a published version for the length of a launch with a shared lock
+// on its lock file. The lock file is separate from the image, whose lock is
+// taken over by the loop device, and is seen by launches on other hosts of
+// a shared file system. Images that were not published have no lock file.
+// The image may have been released between opening it and taking the lock,
+// so it has to still be there afterwards. Returns the lock fd, -1 when
+// there is no lock file or -2 on error.
+int image_version_hold(char *path, int image_fd) {
+    char *lock = strjoin(path, IMAGE_VERSION_LOCK);
+    struct stat image_stat;
+    struct stat path_stat;
+    int lock_fd;
+
+    if ( ( lock_fd = open(lock, O_RDONLY | O_NOFOLLOW) ) < 0 && errno != ENOENT ) {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", lock, strerror(errno));
+        free(lock);
+        return(-2);
+    }
+    if ( lock_fd >= 0 && flock(lock_fd, LOCK_SH) < 0 ) {
+        fprintf(stderr, "ERROR: Could not obtain shared lock on %s: %s\n", lock, strerror(errno));
+        close(lock_fd);
+        free(lock);
+        return(-2);
+    }
+    free(lock);
+
+    if ( fstat(image_fd, &image_stat) < 0 || stat(path, &path_stat) < 0 || image_stat.st_dev != path_stat.st_dev || image_stat.st_ino != path_stat.st_ino ) {
+        fprintf(stderr, "ERROR: Image version was removed while launching, try again: %s\n", path);
+        if ( lock_fd >= 0 ) {
+            close(lock_fd);
+        }
+        return(-2);
+    }
+
+    return(lock_fd);
+}
+
+
+// Mark a published version as replaced, it is removed as soon as nothing
+// is running from it any more
+int image_version_retire(char *path) {
+    char *marker = strjoin(path, IMAGE_VERSION_RETIRED);
+    int marker_fd;
+
+    if ( ( marker_fd = open(marker, O_CREAT | O_WRONLY, 0644) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not retire %s: %s\n", path, strerror(errno));
+        free(marker);
+        return(-1);
+    }
+    close(marker_fd);
+    free(marker);
+
+    return(image_version_release(path) < 0 ? -1 : 0);
+}
+
+
+static int version_release_at(int dir_fd, char *name, char *path) {
+    char *marker = strjoin(name, IMAGE_VERSION_RETIRED);
+    char *digest = strjoin(name, ".digest");
+    char *lock = strjoin(name, IMAGE_VERSION_LOCK);
+    struct stat image_stat;
+    struct stat marker_stat;
+    struct stat open_stat;
+    int image_fd;
+    int lock_fd;
+    int in_use;
+    int retval = 1;
+
+    if ( fstatat(dir_fd, marker, &marker_stat, AT_SYMLINK_NOFOLLOW) < 0 || fstatat(dir_fd, name, &image_stat, AT_SYMLINK_NOFOLLOW) < 0 || ! S_ISREG(image_stat.st_mode) ) {
+        free(marker);
+        free(digest);
+        free(lock);
+        return(1);
+    }
+
+    if ( marker_stat.st_uid != image_stat.st_uid && marker_stat.st_uid != 0 ) {
+        free(marker);
+        free(digest);
+        free(lock);
+        return(1);
+    }
+
+    // The file opened (and locked) must be the one that was checked
+    if ( ( image_fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW) ) < 0 ) {
+        free(marker);
+        free(digest);
+        free(lock);
+        return(1);
+    }
+    if ( fstat(image_fd, &open_stat) < 0 || open_stat.st_dev != image_stat.st_dev || open_stat.st_ino != image_stat.st_ino ) {
+        close(image_fd);
+        free(marker);
+        free(digest);
+        free(lock);
+        return(1);
+    }
+
+    // Every running launch, on any host, holds a shared lock on the lock
+    // file. Versions published without one only know of local launches
+    // through the image lock.
+    // File systems that emulate flock() with record locks only grant an
+    // exclusive lock on a descriptor open for writing
+    if ( ( lock_fd = openat(dir_fd, lock, O_RDWR | O_NOFOLLOW) ) < 0 && errno == EACCES ) {
+        lock_fd = openat(dir_fd, lock, O_RDONLY | O_NOFOLLOW);
+    }
+    if ( lock_fd >= 0 ) {
+        in_use = ( flock(lock_fd, LOCK_EX | LOCK_NB) < 0 );
+    } else if ( errno == ENOENT ) {
+        in_use = ( flock(image_fd, LOCK_EX | LOCK_NB) < 0 );
+    } else {
+        in_use = 1;
+    }
+
+    if ( in_use == 0 ) {
+        if ( unlinkat(dir_fd, name, 0) < 0 ) {
+            fprintf(stderr, "ERROR: Could not remove retired image %s: %s\n", path, strerror(errno));
+            retval = -1;
+        } else {
+            unlinkat(dir_fd, digest, 0);
+            unlinkat(dir_fd, marker, 0);
+            unlinkat(dir_fd, lock, 0);
+            retval = 0;
+        }
+    }
+
+    if ( lock_fd >= 0 ) {
+        close(lock_fd);
+    }
+    close(image_fd);
+    free(marker);
+    free(digest);
+    free(lock);
+
+    return(retval);
+}
+
+
+// Remove a retired version once no launch holds a lock on it. Returns 0 if
+// it was removed, 1 if it is not retired or still in use. The marker has
+// to belong to the owner of the image, so only whoever published it (or
+// root) can have an image released. A launch lets go of its own hold
+// before it tries. Everything is looked up relative to one open directory
+// without following symlinks, so the files checked are the files removed.
+int image_version_release(char *path) {
+    char *dir_copy = strdup(path);
+    char *name_copy = strdup(path);
+    int dir_fd;
+    int retval = 1;
+
+    if ( ( dir_fd = open(dirname(dir_copy), O_RDONLY | O_DIRECTORY) ) >= 0 ) {
+        retval = version_release_at(dir_fd, basename(name_copy), path);
+        close(dir_fd);
+    }
+
+    free(dir_copy);
+    free(name_copy);
+
+    return(retval);
+}
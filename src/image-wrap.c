@@ -0,0 +1,114 @@
+/* 
+ * Copyright (c) 2015-2016, Gregory M. Kurtzer. All rights reserved.
+ * 
+ * “Singularity” Copyright (c) 2016, The Regents of the University of California,
+ * through Lawrence Berkeley National Laboratory (subject to receipt of any
+ * required approvals from the U.S. Dept. of Energy).  All rights reserved.
+ * 
+ * If you have questions about your rights to use or distribute this software,
+ * please contact Berkeley Lab's Innovation & Partnerships Office at
+ * IPO@lbl.gov.
+ * 
+ * NOTICE.  This Software was developed under funding from the U.S. Department of
+ * Energy and the U.S. Government consequently retains certain rights. As such,
+ * the U.S. Government has been granted for itself and others acting on its
+ * behalf a paid-up, nonexclusive, irrevocable, worldwide license in the Software
+ * to reproduce, distribute copies to the public, prepare derivative works, and
+ * perform publicly and display publicly, and to permit other to do so. 
+ * 
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h> 
+#include <string.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "image-header.h"
+#include "image-digest.h"
+#include "sha256.h"
+#include "image-util.h"
+#include "util.h"
+
+
+int main(int argc, char ** argv) {
+    struct image_header header;
+    struct stat filestat;
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    char *runscript = NULL;
+    char *env = NULL;
+    char *rawimage;
+    char *outimage;
+    int raw_fd;
+    int out_fd;
+    int retval;
+
+    if ( argc != 3 ) {
+        fprintf(stderr, "USAGE: %s [raw image] [wrapped image]\n", argv[0]);
+        return(1);
+    }
+
+    rawimage = strdup(argv[1]);
+    outimage = strdup(argv[2]);
+
+    if ( getenv("SINGULARITY_IMAGE_RUNSCRIPT") != NULL ) {
+        if ( ( runscript = filecat(getenv("SINGULARITY_IMAGE_RUNSCRIPT")) ) == NULL ) {
+            fprintf(stderr, "ABORT: Could not read runscript: %s\n", getenv("SINGULARITY_IMAGE_RUNSCRIPT"));
+            return(255);
+        }
+    }
+
+    if ( getenv("SINGULARITY_IMAGE_ENV") != NULL ) {
+        if ( ( env = filecat(getenv("SINGULARITY_IMAGE_ENV")) ) == NULL ) {
+            fprintf(stderr, "ABORT: Could not read environment: %s\n", getenv("SINGULARITY_IMAGE_ENV"));
+            return(255);
+        }
+    }
+
+    if ( ( raw_fd = open(rawimage, O_RDONLY) ) < 0 || fstat(raw_fd, &filestat) < 0 ) {
+        fprintf(stderr, "ABORT: Could not open image %s: %s\n", rawimage, strerror(errno));
+        return(255);
+    }
+
+    if ( ( retval = image_header_read(raw_fd, &header, NULL, NULL) ) != 1 ) {
+        if ( retval == 0 ) {
+            fprintf(stderr, "ABORT: Image already has a header: %s\n", rawimage);
+        }
+        return(255);
+    }
+
+    // Executable so the launcher line can run the image directly
+    if ( ( out_fd = open(outimage, O_CREAT | O_EXCL | O_RDWR, 0755) ) < 0 ) {
+        fprintf(stderr, "ABORT: Could not create %s: %s\n", outimage, strerror(errno));
+        return(255);
+    }
+
+    header.fs_offset = IMAGE_HEADER_SIZE;
+    header.fs_size = filestat.st_size;
+
+    if ( ftruncate(out_fd, header.fs_offset + header.fs_size) < 0 || image_copy_data(raw_fd, 0, out_fd, header.fs_offset, header.fs_size) < 0 ) {
+        fprintf(stderr, "ABORT: Could not copy image to %s: %s\n", outimage, strerror(errno));
+        unlink(outimage);
+        return(255);
+    }
+
+    if ( image_digest(out_fd, header.fs_offset, header.fs_size, header.fs_hash) < 0 || image_header_write(out_fd, &header, runscript, env) < 0 || fsync(out_fd) < 0 ) {
+        fprintf(stderr, "ABORT: Could not write header to %s\n", outimage);
+        unlink(outimage);
+        return(255);
+    }
+
+    close(raw_fd);
+    close(out_fd);
+
+    sha256_hex(header.fs_hash, hex);
+    printf("Wrapped %s into %s (file system hash %s)\n", rawimage, outimage, hex);
+
+    return(0);
+}
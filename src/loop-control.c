@@ -29,6 +29,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
 
 #include "config.h"
 #include "loop-control.h"
@@ -47,23 +48,33 @@ char * obtain_loop_dev(void) {
     int devnum = -1;
     int i;
 
-    // We brute force this to be compatible with older loop implementations
-    // that don't provide /dev/loop-control
-    for( i=0; i < MAX_LOOP_DEVS; i++ ) {
+    // Ask the kernel for a free device first, and otherwise brute force this
+    // to be compatible with older loop implementations that don't provide
+    // /dev/loop-control
+#ifdef LOOP_CTL_GET_FREE
+    if ( ( i = open("/dev/loop-control", O_RDWR) ) >= 0 ) {
+        devnum = ioctl(i, LOOP_CTL_GET_FREE);
+        close(i);
+    }
+#endif
+
+    for( i=0; devnum < 0 && i < MAX_LOOP_DEVS; i++ ) {
         char *test_loopdev = strjoin("/dev/loop", int2str(i));
         struct loop_info loop_status = {0};
         int loop_fd;
 
         if ( ( loop_fd = open(test_loopdev, O_RDONLY) ) < 0 ) {
-            if ( ioctl(loop_fd, LOOP_GET_STATUS, &loop_status) < 0 ) {
-                devnum = i;
-                break;
-            }
+            // Not there yet, it gets created below
+            devnum = i;
 
         } else {
-            devnum = i;
-            break;
+            // Devices without a backing file answer ENXIO
+            if ( ioctl(loop_fd, LOOP_GET_STATUS, &loop_status) < 0 && errno == ENXIO ) {
+                devnum = i;
+            }
+            close(loop_fd);
         }
+        free(test_loopdev);
     }
 
     if ( devnum >= 0 ) {
@@ -87,14 +98,16 @@ char * obtain_loop_dev(void) {
 
 
 
-int associate_loop(int image_fd, char * loop_device) {
+// Maps sizelimit bytes of the image starting at offset (0 for the rest of
+// the file), so images with a header in front can be mounted
+int associate_loop(int image_fd, char * loop_device, unsigned long long offset, unsigned long long sizelimit) {
     int loop_fd;
     struct loop_info64 lo64 = {0};
-    int offset = 0;
 
     lo64.lo_flags = LO_FLAGS_AUTOCLEAR;
 //    strncpy((char*)lo64.lo_file_name, "Singularity", LO_NAME_SIZE);
     lo64.lo_offset = offset;
+    lo64.lo_sizelimit = sizelimit;
 
     //printf("Opening image: %s\n", image_path);
 //    if ( (image_fd = open(image_path, O_RDWR)) < 0 ) {
@@ -111,12 +124,14 @@ int associate_loop(int image_fd, char * loop_device) {
     //printf("Associating image to loop device\n");
     if ( ioctl(loop_fd, LOOP_SET_FD, image_fd) < 0 ) {
         fprintf(stderr, "ERROR: Failed to associate image to loop\n");
+        close(loop_fd);
         return(-1);
     }
 
     if ( ioctl(loop_fd, LOOP_SET_STATUS64, &lo64) < 0 ) {
         (void)ioctl(loop_fd, LOOP_CLR_FD, 0);
         fprintf(stderr, "ERROR: Failed to set loop flags on %s: %s\n", loop_device, strerror(errno));
+        close(loop_fd);
         return(-1);
     }
 
@@ -124,3 +139,58 @@ int associate_loop(int image_fd, char * loop_device) {
 }
 
 
+// Loop devices are shared by every launch of the same image: the first
+// process in associates the image and caches the device name in tmpdir,
+// later ones wait for that and reuse it. The lock is held until exit.
+// A device attached from a read only descriptor can not be written, so
+// those are shared separately from the read/write ones.
+char * loop_attach_shared(int image_fd, char * tmpdir, unsigned long long offset, unsigned long long sizelimit) {
+    int readonly = ( fcntl(image_fd, F_GETFL) & O_ACCMODE ) == O_RDONLY;
+    char *lockfile = joinpath(tmpdir, readonly ? "lock.ro" : "lock");
+    char *loop_dev_cache = joinpath(tmpdir, readonly ? "loop_dev.ro" : "loop_dev");
+    char *loop_dev;
+    int lockfile_fd;
+
+    if ( ( lockfile_fd = open(lockfile, O_CREAT | O_RDWR, 0644) ) < 0 ) {
+        fprintf(stderr, "ERROR: Could not open lockfile %s: %s\n", lockfile, strerror(errno));
+        return(NULL);
+    }
+
+    if ( flock(lockfile_fd, LOCK_EX | LOCK_NB) == 0 ) {
+        int tries;
+
+        // Another image may grab the same free device between us finding
+        // it and associating it, so go around again when that happens
+        for ( tries = 0; ; tries++ ) {
+            if ( ( loop_dev = obtain_loop_dev() ) == NULL ) {
+                fprintf(stderr, "ERROR: Could not obtain a free loop device\n");
+                return(NULL);
+            }
+            if ( associate_loop(image_fd, loop_dev, offset, sizelimit) == 0 ) {
+                break;
+            }
+            if ( tries >= 3 ) {
+                fprintf(stderr, "ERROR: Could not associate image to loop device %s\n", loop_dev);
+                return(NULL);
+            }
+        }
+
+        if ( fileput(loop_dev_cache, loop_dev) < 0 ) {
+            fprintf(stderr, "ERROR: Could not write to loop_dev_cache %s: %s\n", loop_dev_cache, strerror(errno));
+            return(NULL);
+        }
+        flock(lockfile_fd, LOCK_SH | LOCK_NB);
+
+    } else {
+        flock(lockfile_fd, LOCK_SH);
+        if ( ( loop_dev = filecat(loop_dev_cache) ) == NULL ) {
+            fprintf(stderr, "ERROR: Could not retrieve loop_dev_cache from %s\n", loop_dev_cache);
+            return(NULL);
+        }
+    }
+
+    free(lockfile);
+    free(loop_dev_cache);
+
+    return(loop_dev);
+}
@@ -20,6 +20,7 @@
 
 
 char *obtain_loop_dev(void);
-int associate_loop(int image_fd, char * loop_device);
+int associate_loop(int image_fd, char * loop_device, unsigned long long offset, unsigned long long sizelimit);
+char * loop_attach_shared(int image_fd, char * tmpdir, unsigned long long offset, unsigned long long sizelimit);
 
 
@@ -34,17 +34,20 @@
 #include <fcntl.h>  
 #include <grp.h>
 #include <libgen.h>
+#include <stdint.h>
 
 #include "config.h"
 #include "mounts.h"
 #include "util.h"
 #include "loop-control.h"
+#include "image-header.h"
 
 
 int main(int argc, char ** argv) {
     char *containerimage;
     char *mountpoint;
     char *loop_dev;
+    struct image_header header;
     int containerimage_fd;
     uid_t uid = geteuid();
 
@@ -76,14 +79,19 @@ int main(int argc, char ** argv) {
         return(255);
     }
 
+    if ( image_header_read(containerimage_fd, &header, NULL, NULL) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        return(255);
+    }
+
     loop_dev = obtain_loop_dev();
 
-    if ( associate_loop(containerimage_fd, loop_dev) < 0 ) {
+    if ( associate_loop(containerimage_fd, loop_dev, header.fs_offset, header.fs_offset > 0 ? header.fs_size : 0) < 0 ) {
         fprintf(stderr, "ERROR: Could not associate %s to loop device %s\n", containerimage, loop_dev);
         return(255);
     }
 
-    if ( mount_image(loop_dev, mountpoint, 1) < 0 ) {
+    if ( mount_image(loop_dev, mountpoint, 1, "default") < 0 ) {
         fprintf(stderr, "ABORT: exiting...\n");
         return(255);
     }
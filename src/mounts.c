@@ -19,6 +19,7 @@
  */
 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -30,14 +31,124 @@
 #include <string.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include "config.h"
 #include "mounts.h"
 #include "util.h"
 #include "loop-control.h"
+#include "config-parser.h"
 
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_FEATURE_COMPAT_HAS_JOURNAL 0x4
 
-int mount_image(char * loop_device, char * mount_point, int writable) {
+
+// Mount profiles tune the options for how an image is used. 'default' is
+// what images have always been mounted with. 'launch' is for read only
+// containers: a read only mount never writes, so there is no journal to
+// replay and nothing to discard. 'build' is for heavy writes: commits are
+// batched and file data skips the journal (when there is one), and
+// instead of a trim per delete the free space is trimmed once at the end.
+struct mount_profile {
+    char *name;
+    unsigned long flags;
+    char *options;
+    char *journal_options;
+    int trim;
+};
+
+static struct mount_profile mount_profiles[] = {
+    { "default", 0, "discard", "", 0 },
+    { "launch", MS_NOATIME, "norecovery", "", 0 },
+    { "build", MS_NOATIME, "", "commit=60,data=writeback", 1 },
+    { NULL, 0, NULL, NULL, 0 }
+};
+
+
+static struct mount_profile *mount_profile_find(char *name) {
+    int i;
+
+    for ( i = 0; mount_profiles[i].name != NULL; i++ ) {
+        if ( name != NULL && strcmp(mount_profiles[i].name, name) == 0 ) {
+            return(&mount_profiles[i]);
+        }
+    }
+
+    return(NULL);
+}
+
+
+// Images are ext4 unless the device carries a squashfs superblock
+static char *image_fstype(char * device) {
+    unsigned char magic[4];
+    int fd;
+
+    if ( ( fd = open(device, O_RDONLY) ) < 0 ) {
+        return("ext4");
+    }
+
+    if ( pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, "hsqs", 4) == 0 ) {
+        close(fd);
+        return("squashfs");
+    }
+
+    close(fd);
+
+    return("ext4");
+}
+
+
+static int image_has_journal(char * device) {
+    unsigned char sb[1024];
+    uint32_t compat = 0;
+    int fd;
+
+    if ( ( fd = open(device, O_RDONLY) ) < 0 ) {
+        return(0);
+    }
+
+    if ( pread(fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET) == sizeof(sb) ) {
+        memcpy(&compat, sb + 0x5C, sizeof(compat));
+    }
+
+    close(fd);
+
+    return(( compat & EXT4_FEATURE_COMPAT_HAS_JOURNAL ) ? 1 : 0);
+}
+
+
+// The profile set for a command with 'mount profile <command>' in the
+// configuration, or the given default. The configuration must be open.
+char *mount_profile(char *command, char *def) {
+    char *key = strjoin("mount profile ", command);
+    char *value;
+
+    config_rewind();
+    value = config_get_key_value(key);
+    free(key);
+
+    if ( value == NULL ) {
+        return(def);
+    }
+
+    if ( mount_profile_find(value) == NULL ) {
+        fprintf(stderr, "WARNING: Unknown mount profile for %s: %s\n", command, value);
+        free(value);
+        return(def);
+    }
+
+    return(value);
+}
+
+
+int mount_image(char * loop_device, char * mount_point, int writable, char * profile) {
+    struct mount_profile *settings;
+    unsigned long flags = MS_NOSUID;
+    char *options;
+    char *fstype;
 
     if ( is_dir(mount_point) < 0 ) {
         fprintf(stderr, "ERROR: Mount point is not available: %s\n", mount_point);
@@ -49,18 +160,86 @@ int mount_image(char * loop_device, char * mount_point, int writable) {
         return(-1);
     }
 
-    if ( writable > 0 ) {
-        if ( mount(loop_device, mount_point, "ext4", MS_NOSUID, "discard") < 0 ) {
-            fprintf(stderr, "ERROR: Failed to mount '%s' at '%s': %s\n", loop_device, mount_point, strerror(errno));
+    if ( ( settings = mount_profile_find(profile) ) == NULL ) {
+        settings = mount_profile_find("default");
+    }
+
+    // Skipping journal recovery is only safe when nothing is written
+    if ( writable > 0 && strcmp(settings->name, "launch") == 0 ) {
+        fprintf(stderr, "WARNING: Mount profile 'launch' is read only, using 'default'\n");
+        settings = mount_profile_find("default");
+    }
+
+    fstype = image_fstype(loop_device);
+
+    if ( strcmp(fstype, "squashfs") == 0 ) {
+        if ( writable > 0 ) {
+            fprintf(stderr, "ERROR: Compressed (squashfs) images can not be mounted writable\n");
             return(-1);
         }
-    } else {
-        if ( mount(loop_device, mount_point, "ext4", MS_NOSUID|MS_RDONLY, "discard") < 0 ) {
+        if ( mount(loop_device, mount_point, fstype, MS_NOSUID|MS_RDONLY, NULL) < 0 ) {
             fprintf(stderr, "ERROR: Failed to mount '%s' at '%s': %s\n", loop_device, mount_point, strerror(errno));
             return(-1);
         }
+        return(0);
     }
 
+    flags |= settings->flags;
+    if ( writable <= 0 ) {
+        flags |= MS_RDONLY;
+    }
+
+    if ( settings->journal_options[0] != '\0' && image_has_journal(loop_device) ) {
+        options = strjoin(strjoin(settings->options, ( settings->options[0] != '\0' ) ? "," : ""), settings->journal_options);
+    } else {
+        options = strdup(settings->options);
+    }
+
+    if ( mount(loop_device, mount_point, fstype, flags, options) < 0 ) {
+        fprintf(stderr, "ERROR: Failed to mount '%s' at '%s': %s\n", loop_device, mount_point, strerror(errno));
+        free(options);
+        return(-1);
+    }
+
+    free(options);
+
+    return(0);
+}
+
+
+// Profiles without online discard trim the free space in one pass once the
+// writes are done. Not every file system or loop backing file supports it.
+int mount_image_trim(char * mount_point, char * profile) {
+    struct mount_profile *settings = mount_profile_find(profile);
+    struct fstrim_range range;
+    int fd;
+
+    if ( settings == NULL || settings->trim == 0 ) {
+        return(0);
+    }
+
+    if ( ( fd = open(mount_point, O_RDONLY | O_DIRECTORY) ) < 0 ) {
+        fprintf(stderr, "WARNING: Could not open %s to trim it: %s\n", mount_point, strerror(errno));
+        return(-1);
+    }
+
+    // Blocks freed by writes still in memory are not free on disk yet
+    syncfs(fd);
+
+    range.start = 0;
+    range.len = ULLONG_MAX;
+    range.minlen = 0;
+
+    if ( ioctl(fd, FITRIM, &range) < 0 ) {
+        if ( errno != EOPNOTSUPP && errno != ENOTTY ) {
+            fprintf(stderr, "WARNING: Could not trim %s: %s\n", mount_point, strerror(errno));
+        }
+        close(fd);
+        return(-1);
+    }
+
+    close(fd);
+
     return(0);
 }
 
@@ -91,3 +270,33 @@ int mount_bind(char * source, char * dest, int writable) {
 
     return(0);
 }
+
+
+// Directory containers are bound in place of a loop mounted image, with
+// the same nosuid restriction as an image mount. Mounts below the directory
+// are left out, like an image has none, as a remount only restricts the
+// top mount of a recursive bind.
+int mount_dir(char * source, char * mount_point, int writable) {
+    unsigned long flags = MS_BIND|MS_REMOUNT|MS_NOSUID;
+
+    if ( is_dir(source) < 0 ) {
+        fprintf(stderr, "ERROR: Container directory does not exist: %s\n", source);
+        return(-1);
+    }
+
+    if ( mount(source, mount_point, NULL, MS_BIND, NULL) < 0 ) {
+        fprintf(stderr, "ERROR: Could not bind mount %s at %s: %s\n", source, mount_point, strerror(errno));
+        return(-1);
+    }
+
+    if ( writable <= 0 ) {
+        flags |= MS_RDONLY;
+    }
+
+    if ( mount(NULL, mount_point, NULL, flags, NULL) < 0 ) {
+        fprintf(stderr, "ERROR: Could not restrict bind mount %s: %s\n", mount_point, strerror(errno));
+        return(-1);
+    }
+
+    return(0);
+}
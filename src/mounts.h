@@ -19,5 +19,8 @@
  */
 
 
-int mount_image(char * image_path, char * mount_point, int writable);
+char *mount_profile(char *command, char *def);
+int mount_image(char * image_path, char * mount_point, int writable, char * profile);
+int mount_image_trim(char * mount_point, char * profile);
 int mount_bind(char * source, char * dest, int writable);
+int mount_dir(char * source, char * mount_point, int writable);
@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/param.h>
+#include <sys/time.h>
 #include <errno.h> 
 #include <signal.h>
 #include <sched.h>
@@ -35,12 +36,20 @@
 #include <fcntl.h>  
 #include <grp.h>
 #include <libgen.h>
+#include <utime.h>
+#include <time.h>
+#include <stdint.h>
 
 #include "config.h"
 #include "mounts.h"
 #include "loop-control.h"
 #include "util.h"
 #include "user.h"
+#include "image-digest.h"
+#include "image-header.h"
+#include "image-version.h"
+#include "config-parser.h"
+#include "image-prefetch.h"
 
 
 #ifndef LIBEXECDIR
@@ -53,9 +62,24 @@
 #define LOCALSTATEDIR "/var/"
 #endif
 
+#define MAX_EXTRA_IMAGES 64
+
+// Successful image verifications are remembered here, root only
+#define VERIFY_CACHE_DIR LOCALSTATEDIR "/singularity/verified"
+
 // Yes, I know... Global variables suck but necessary to pass sig to child
 pid_t child_pid = 0;
 
+// Read only data images and layers attached next to the container image
+struct extra_image {
+    char *path;
+    char *dest;
+    char *tmpdir;
+    int fd;
+    int lock_fd;
+    int tmpdirlock_fd;
+};
+
 
 void sighandler(int sig) {
     signal(sig, sighandler);
@@ -72,8 +96,224 @@ void sighandler(int sig) {
 }
 
 
+// Extra images are given as a newline separated list, data images as
+// image:/dest pairs. They are opened here with the caller's privileges so
+// root can not be used to read images the caller could not read themselves.
+int open_extra_images(char *list, struct extra_image *images, uid_t uid, int with_dest) {
+    char *entry;
+    int count = 0;
+
+    for ( entry = strtok(list, "\n"); entry != NULL; entry = strtok(NULL, "\n") ) {
+        if ( count >= MAX_EXTRA_IMAGES ) {
+            fprintf(stderr, "ERROR: Too many images (max %d)\n", MAX_EXTRA_IMAGES);
+            return(-1);
+        }
+
+        images[count].dest = NULL;
+
+        if ( with_dest > 0 ) {
+            char *colon = strrchr(entry, ':');
+
+            if ( colon == NULL || colon[1] != '/' ) {
+                fprintf(stderr, "ERROR: Data images must be given as image:/path (got '%s')\n", entry);
+                return(-1);
+            }
+            *colon = '\0';
+            images[count].dest = colon + 1;
+        }
+
+        // Published names resolve to their current version, as for the
+        // container image
+        if ( ( images[count].path = realpath(entry, NULL) ) == NULL || is_file(images[count].path) != 0 ) {
+            fprintf(stderr, "ERROR: Image path is invalid: %s\n", entry);
+            return(-1);
+        }
+
+        if ( is_owner(images[count].path, uid) < 0 && is_owner(images[count].path, 0) < 0 ) {
+            fprintf(stderr, "ERROR: Will not mount an image you (or root) does not own: %s\n", images[count].path);
+            return(-1);
+        }
+
+        if ( ( images[count].fd = open(images[count].path, O_RDONLY) ) < 0 ) {
+            fprintf(stderr, "ERROR: Could not open image %s: %s\n", images[count].path, strerror(errno));
+            return(-1);
+        }
+
+        if ( ( images[count].lock_fd = image_version_hold(images[count].path, images[count].fd) ) < -1 ) {
+            return(-1);
+        }
+
+        // Like the container image's, the temporary directory belongs to
+        // the caller
+        images[count].tmpdir = strjoin("/tmp/.singularity-", file_id(images[count].path));
+        if ( s_mkpath(images[count].tmpdir, 0750) < 0 ) {
+            fprintf(stderr, "ERROR: Could not create temporary directory %s: %s\n", images[count].tmpdir, strerror(errno));
+            return(-1);
+        }
+
+        if ( ( images[count].tmpdirlock_fd = open(images[count].tmpdir, O_RDONLY) ) < 0 || flock(images[count].tmpdirlock_fd, LOCK_SH | LOCK_NB) < 0 ) {
+            fprintf(stderr, "ERROR: Could not obtain shared lock on %s: %s\n", images[count].tmpdir, strerror(errno));
+            return(-1);
+        }
+        count++;
+    }
+
+    return(count);
+}
+
+
+// Extra images are verified before the PID namespace is entered, threads
+// can not be created after that to hash them in parallel
+int verify_extra_images(struct extra_image *images, int count) {
+    int i;
+
+    for ( i = 0; i < count; i++ ) {
+        if ( image_digest_verify(images[i].path, images[i].fd, VERIFY_CACHE_DIR) < 0 ) {
+            fprintf(stderr, "ERROR: Image failed integrity verification: %s\n", images[i].path);
+            return(-1);
+        }
+    }
+
+    return(0);
+}
+
+
+// Attach an extra image to its shared read only loop device
+char *attach_extra_image(struct extra_image *image) {
+    struct image_header header;
+
+    if ( flock(image->fd, LOCK_SH | LOCK_NB) < 0 ) {
+        fprintf(stderr, "ERROR: Image is locked by another process: %s\n", image->path);
+        return(NULL);
+    }
+
+    if ( image_header_read(image->fd, &header, NULL, NULL) < 0 ) {
+        fprintf(stderr, "ERROR: Could not read image header: %s\n", image->path);
+        return(NULL);
+    }
+
+    return(loop_attach_shared(image->fd, image->tmpdir, header.fs_offset, header.fs_offset > 0 ? header.fs_size : 0));
+}
+
+
+// Mount a data image over a directory that already exists in the container
+int mount_data_image(struct extra_image *image, char *containerpath, char *profile) {
+    char *loop_dev;
+    char *target;
+    char *resolved;
+
+    if ( ( loop_dev = attach_extra_image(image) ) == NULL ) {
+        return(-1);
+    }
+
+    // Symlinks within the image must not redirect the mount onto the host
+    target = joinpath(containerpath, image->dest);
+    if ( ( resolved = realpath(target, NULL) ) == NULL || is_dir(resolved) < 0 ) {
+        fprintf(stderr, "ERROR: Data image mount point does not exist in container: %s\n", image->dest);
+        return(-1);
+    }
+    if ( strncmp(resolved, containerpath, strlen(containerpath)) != 0 || ( resolved[strlen(containerpath)] != '/' && resolved[strlen(containerpath)] != '\0' ) ) {
+        fprintf(stderr, "ERROR: Data image mount point leaves the container: %s\n", image->dest);
+        return(-1);
+    }
+
+    if ( mount_image(loop_dev, resolved, 0, profile) < 0 ) {
+        return(-1);
+    }
+
+    free(target);
+    free(resolved);
+
+    return(0);
+}
+
+
+// Mount each layer read only in its own directory and stack them over the
+// container image, the last layer given ends up on top
+int mount_layers(struct extra_image *layers, int count, char *basepath, char *containerpath, char *profile) {
+    char *lowerdir = strdup(basepath);
+    int i;
+
+    for ( i = 0; i < count; i++ ) {
+        char *layerpath = joinpath(joinpath(LOCALSTATEDIR, "singularity/layers"), int2str(i + 1));
+        char *loop_dev;
+
+        if ( s_mkpath(layerpath, 0755) < 0 ) {
+            fprintf(stderr, "ERROR: Could not create directory %s: %s\n", layerpath, strerror(errno));
+            return(-1);
+        }
+
+        if ( ( loop_dev = attach_extra_image(&layers[i]) ) == NULL ) {
+            return(-1);
+        }
+
+        if ( mount_image(loop_dev, layerpath, 0, profile) < 0 ) {
+            return(-1);
+        }
+
+        lowerdir = strjoin(strjoin(layerpath, ":"), lowerdir);
+    }
+
+    if ( mount("overlay", containerpath, "overlay", MS_NOSUID|MS_RDONLY, strjoin("lowerdir=", lowerdir)) < 0 ) {
+        fprintf(stderr, "ERROR: Could not stack image layers at %s: %s\n", containerpath, strerror(errno));
+        return(-1);
+    }
+
+    return(0);
+}
+
+
+// Keep the launch's locks, loop devices and mounts alive in a detached
+// process so the next launch of the image can reuse them. Returns the
+// reaper's pid in the caller, 0 in the reaper once linger_time is up and
+// -1 if no reaper could be started.
+pid_t linger(int linger_time, char *tmpdir) {
+    struct stat tmpdir_stat;
+    int pidns_fd;
+    int null_fd;
+    int idle = 0;
+    pid_t pid;
+
+    // New children would go into the container's PID namespace, which
+    // ended with the container, so move them back into our own
+    if ( ( pidns_fd = open("/proc/self/ns/pid", O_RDONLY) ) >= 0 ) {
+        (void)setns(pidns_fd, CLONE_NEWPID);
+        close(pidns_fd);
+    }
+
+    if ( ( pid = fork() ) != 0 ) {
+        return(pid);
+    }
+
+    setsid();
+    if ( chdir("/") < 0 ) {
+        fprintf(stderr, "WARNING: Could not chdir to / while lingering\n");
+    }
+    if ( ( null_fd = open("/dev/null", O_RDWR) ) >= 0 ) {
+        dup2(null_fd, 0);
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+        close(null_fd);
+    }
+
+    // Launches that end while we wait touch the launch directory, the
+    // linger time counts from the last of them
+    while ( idle < linger_time ) {
+        sleep(linger_time - idle);
+        if ( stat(tmpdir, &tmpdir_stat) < 0 ) {
+            break;
+        }
+        idle = time(NULL) - tmpdir_stat.st_mtime;
+    }
+
+    return(0);
+}
+
+
 int main(int argc, char ** argv) {
     char *containerimage;
+    char *containerimage_real;
+    char *config_path;
     char *containername;
     char *containerpath;
     char *homepath;
@@ -81,15 +321,36 @@ int main(int argc, char ** argv) {
     char *command_exec;
     char *tmpdir;
     char *lockfile;
-    char *loop_dev_cache;
     char *loop_dev = 0;
+    char *dataimage_list;
+    char *layer_list;
+    char *hotlist;
+    char *imagepath;
+    char *header_runscript = NULL;
+    char *header_env = NULL;
     char *basehomepath;
+    char *profile = "launch";
+    char *containdir = NULL;
     char cwd[PATH_MAX];
     int cwd_fd;
     int tmpdirlock_fd;
     int containerimage_fd;
-    int lockfile_fd;
+    int containerlock_fd = -1;
+    int dataimage_count = 0;
+    int layer_count = 0;
+    int linger_time;
+    int contain_tmpfs;
+    int contain_size;
+    int warm_time = 0;
+    int hotlist_fd = -1;
+    long long prefetch_bytes = 0;
+    double prefetch_seconds = 0;
     int retval = 0;
+    int verified;
+    int i;
+    struct extra_image dataimages[MAX_EXTRA_IMAGES];
+    struct extra_image layers[MAX_EXTRA_IMAGES];
+    struct image_header header = {{0}};
     uid_t uid = getuid();
     gid_t gid = getgid();
 
@@ -108,10 +369,63 @@ int main(int argc, char ** argv) {
     containerimage = getenv("SINGULARITY_IMAGE");
     command = getenv("SINGULARITY_COMMAND");
     command_exec = getenv("SINGULARITY_EXEC");
+    dataimage_list = getenv("SINGULARITY_DATAIMAGES");
+    layer_list = getenv("SINGULARITY_LAYERS");
+
+    if ( command != NULL && strcmp(command, "warm") == 0 ) {
+        warm_time = 1;
+    }
 
     unsetenv("SINGULARITY_IMAGE");
     unsetenv("SINGULARITY_COMMAND");
     unsetenv("SINGULARITY_EXEC");
+    unsetenv("SINGULARITY_DATAIMAGES");
+    unsetenv("SINGULARITY_LAYERS");
+
+    config_path = joinpath(SYSCONFDIR, "/singularity/singularity.conf");
+    if ( is_file(config_path) == 0 ) {
+        if ( is_owner(config_path, 0) < 0 ) {
+            fprintf(stderr, "ABORT: Configuration file is not owned by root: %s\n", config_path);
+            return(255);
+        }
+        if ( config_open(config_path) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+    }
+
+    linger_time = config_get_key_int("linger time", 0);
+    contain_tmpfs = config_get_key_bool("contain tmpfs", 0);
+    contain_size = config_get_key_int("contain tmpfs size", 0);
+
+    if ( command != NULL ) {
+        profile = mount_profile(command, profile);
+    }
+    // Writable launches can not skip journal recovery, so the read only
+    // launch profile does not apply to them
+    if ( getenv("SINGULARITY_WRITABLE") != NULL && strcmp(profile, "launch") == 0 ) {
+        profile = "default";
+    }
+
+    // Warming keeps the launch alive for the warm time, callers may only
+    // ask for less
+    if ( warm_time > 0 ) {
+        warm_time = config_get_key_int("warm time", 600);
+        if ( getenv("SINGULARITY_WARM_TIME") != NULL ) {
+            int requested = atoi(getenv("SINGULARITY_WARM_TIME"));
+            if ( requested > 0 && requested < warm_time ) {
+                warm_time = requested;
+            }
+        }
+        if ( warm_time <= 0 ) {
+            fprintf(stderr, "ABORT: Warming images is disabled by the warm time configuration\n");
+            return(255);
+        }
+        if ( getenv("SINGULARITY_WRITABLE") != NULL ) {
+            fprintf(stderr, "ABORT: Images can not be warmed writable\n");
+            return(255);
+        }
+    }
 
     // Figure out where we start
     if ( (cwd_fd = open(".", O_RDONLY)) < 0 ) {
@@ -128,7 +442,18 @@ int main(int argc, char ** argv) {
         return(1);
     }
 
-    if ( is_file(containerimage) != 0 ) {
+    // Resolve symlinks so a published name maps to the version it points
+    // to right now, the launch stays on that version even if a newer one
+    // is published while it runs
+    containername = basename(strdup(containerimage));
+    hotlist = strjoin(containerimage, PREFETCH_HOTLIST_SUFFIX);
+    if ( ( containerimage_real = realpath(containerimage, NULL) ) == NULL ) {
+        fprintf(stderr, "ABORT: Container image path is invalid: %s\n", containerimage);
+        return(1);
+    }
+    containerimage = containerimage_real;
+
+    if ( is_file(containerimage) != 0 && is_dir(containerimage) != 0 ) {
         fprintf(stderr, "ABORT: Container image path is invalid: %s\n", containerimage);
         return(1);
     }
@@ -150,7 +475,45 @@ int main(int argc, char ** argv) {
         return(255);
     }
 
-    containername = basename(strdup(containerimage));
+    // The hot list is read as the caller, it only names ranges to prefetch
+    if ( warm_time > 0 && getenv("SINGULARITY_WARM_PREFETCH") != NULL && is_file(hotlist) == 0 ) {
+        if ( ( hotlist_fd = open(hotlist, O_RDONLY) ) < 0 ) {
+            fprintf(stderr, "ERROR: Could not open hot list %s: %s\n", hotlist, strerror(errno));
+            return(255);
+        }
+    }
+
+    if ( dataimage_list != NULL ) {
+        if ( ( dataimage_count = open_extra_images(strdup(dataimage_list), dataimages, uid, 1) ) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+    }
+
+    if ( layer_list != NULL ) {
+        if ( getenv("SINGULARITY_WRITABLE") != NULL ) {
+            fprintf(stderr, "ABORT: Layered containers can not be mounted writable\n");
+            return(255);
+        }
+        if ( ( layer_count = open_extra_images(strdup(layer_list), layers, uid, 0) ) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+    }
+
+    // Directory containers (e.g. a bootstrap root) skip the loop device and
+    // are only trusted when root owns them
+    if ( is_dir(containerimage) == 0 ) {
+        if ( is_owner(containerimage, 0) < 0 ) {
+            fprintf(stderr, "ABORT: Directory containers must be owned by root: %s\n", containerimage);
+            return(255);
+        }
+        if ( getenv("SINGULARITY_WRITABLE") != NULL && uid != 0 ) {
+            fprintf(stderr, "ABORT: Only root can use a directory container writable\n");
+            return(255);
+        }
+    }
+
     basehomepath = strjoin("/", strtok(strdup(homepath), "/"));
 
     containerpath = (char *) malloc(strlen(LOCALSTATEDIR) + 18);
@@ -158,7 +521,6 @@ int main(int argc, char ** argv) {
 
     tmpdir = strjoin("/tmp/.singularity-", file_id(containerimage));
     lockfile = joinpath(tmpdir, "lock");
-    loop_dev_cache = joinpath(tmpdir, "loop_dev");
 
 
 //****************************************************************************//
@@ -180,13 +542,9 @@ int main(int argc, char ** argv) {
         return(255);
     }
 
-    if ( ( lockfile_fd = open(lockfile, O_CREAT | O_RDWR, 0644) ) < 0 ) {
-        fprintf(stderr, "ERROR: Could not open lockfile %s: %s\n", lockfile, strerror(errno));
-        return(255);
-    }
-
-    // When we contain, we need temporary directories for what should be writable
-    if ( getenv("SINGULARITY_CONTAIN") != NULL ) {
+    // When we contain, we need temporary directories for what should be
+    // writable. On tmpfs they are made once the launch's namespace exists.
+    if ( getenv("SINGULARITY_CONTAIN") != NULL && contain_tmpfs <= 0 ) {
         if ( s_mkpath(joinpath(tmpdir, homepath), 0750) < 0 ) {
             fprintf(stderr, "ABORT: Failed creating temporary directory %s: %s\n", joinpath(tmpdir, homepath), strerror(errno));
             return(255);
@@ -209,6 +567,76 @@ int main(int argc, char ** argv) {
         }
     }
 
+    // With layers the container image is only the bottom of the stack
+    if ( layer_count > 0 ) {
+        imagepath = joinpath(LOCALSTATEDIR, "singularity/layers/0");
+        if ( s_mkpath(imagepath, 0755) < 0 ) {
+            fprintf(stderr, "ABORT: Could not create directory %s: %s\n", imagepath, strerror(errno));
+            return(255);
+        }
+    } else {
+        imagepath = containerpath;
+    }
+
+    if ( is_dir(containerimage) == 0 ) {
+        if ( ( containerimage_fd = open(containerimage, O_RDONLY) ) < 0 ) {
+            fprintf(stderr, "ERROR: Could not open container directory %s: %s\n", containerimage, strerror(errno));
+            return(255);
+        }
+    } else {
+        if ( ( containerimage_fd = open(containerimage, O_RDWR) ) < 0 ) {
+            fprintf(stderr, "ERROR: Could not open image %s: %s\n", containerimage, strerror(errno));
+            return(255);
+        }
+
+        // A published version is kept for as long as any launch holds it
+        if ( ( containerlock_fd = image_version_hold(containerimage, containerimage_fd) ) < -1 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+
+        // The descriptor that is verified is the one attached. Only hash the
+        // image when it or its digest changed since the last verified launch,
+        // and do it before the PID namespace, where no threads can be made.
+        if ( ( verified = image_digest_verify(containerimage, containerimage_fd, VERIFY_CACHE_DIR) ) < 0 ) {
+            fprintf(stderr, "ABORT: Image failed integrity verification: %s\n", containerimage);
+            return(255);
+        }
+        if ( verified == 0 && getenv("SINGULARITY_WRITABLE") != NULL ) {
+            fprintf(stderr, "WARNING: Changes to a signed image must be signed again before it can be launched\n");
+        }
+
+        // Wrapped images carry the runscript and environment in the header
+        if ( image_header_read(containerimage_fd, &header, &header_runscript, &header_env) < 0 ) {
+            fprintf(stderr, "ABORT: Could not read image header: %s\n", containerimage);
+            return(255);
+        }
+    }
+
+    if ( verify_extra_images(dataimages, dataimage_count) < 0 || verify_extra_images(layers, layer_count) < 0 ) {
+        fprintf(stderr, "ABORT: exiting...\n");
+        return(255);
+    }
+
+    // Prefetching reads the image with a pool of threads, which can not be
+    // created once the PID namespace is entered
+    if ( warm_time > 0 && getenv("SINGULARITY_WARM_PREFETCH") != NULL ) {
+        struct timeval start;
+        struct timeval end;
+
+        gettimeofday(&start, NULL);
+        if ( is_dir(containerimage) == 0 ) {
+            fprintf(stderr, "WARNING: Directory containers are not prefetched\n");
+        } else if ( image_prefetch(containerimage_fd, hotlist_fd, &prefetch_bytes) < 0 ) {
+            fprintf(stderr, "WARNING: Could not prefetch %s\n", containerimage);
+        }
+        gettimeofday(&end, NULL);
+        if ( hotlist_fd >= 0 ) {
+            close(hotlist_fd);
+        }
+        prefetch_seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_usec - start.tv_usec ) / 1000000.0;
+    }
+
 
 //****************************************************************************//
 // Setup namespaces                                                           //
@@ -271,28 +699,9 @@ int main(int argc, char ** argv) {
 // Mount image                                                                //
 //****************************************************************************//
 
-    if ( ( containerimage_fd = open(containerimage, O_RDWR) ) < 0 ) {
-        fprintf(stderr, "ERROR: Could not open image %s: %s\n", containerimage, strerror(errno));
-        return(255);
-    }
-
-    if ( flock(lockfile_fd, LOCK_EX | LOCK_NB) == 0 ) {
-        loop_dev = obtain_loop_dev();
-        if ( associate_loop(containerimage_fd, loop_dev) < 0 ) {
-            fprintf(stderr, "ERROR: Could not associate %s to loop device %s\n", containerimage, loop_dev);
-            return(255);
-        }
-
-        if ( fileput(loop_dev_cache, loop_dev) < 0 ) {
-            fprintf(stderr, "ERROR: Could not write to loop_dev_cache %s: %s\n", loop_dev_cache, strerror(errno));
-            return(255);
-        }
-        flock(lockfile_fd, LOCK_SH | LOCK_NB);
-
-    } else {
-        flock(lockfile_fd, LOCK_SH);
-        if ( ( loop_dev = filecat(loop_dev_cache) ) == NULL ) {
-            fprintf(stderr, "ERROR: Could not retrieve loop_dev_cache from %s\n", loop_dev_cache);
+    if ( is_dir(containerimage) != 0 ) {
+        if ( ( loop_dev = loop_attach_shared(containerimage_fd, tmpdir, header.fs_offset, header.fs_offset > 0 ? header.fs_size : 0) ) == NULL ) {
+            fprintf(stderr, "ABORT: exiting...\n");
             return(255);
         }
     }
@@ -303,16 +712,34 @@ int main(int argc, char ** argv) {
             fprintf(stderr, "ABORT: Image is locked by another process\n");
             return(5);
         }
-        if ( mount_image(loop_dev, containerpath, 0) < 0 ) {
+        if ( loop_dev != NULL ) {
+            if ( mount_image(loop_dev, imagepath, 0, profile) < 0 ) {
+                fprintf(stderr, "ABORT: exiting...\n");
+                return(255);
+            }
+        } else if ( mount_dir(containerimage, imagepath, 0) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
+        if ( layer_count > 0 && mount_layers(layers, layer_count, imagepath, containerpath, profile) < 0 ) {
             fprintf(stderr, "ABORT: exiting...\n");
             return(255);
         }
     } else {
         if ( flock(containerimage_fd, LOCK_EX | LOCK_NB) < 0 ) {
-            fprintf(stderr, "ABORT: Image is locked by another process\n");
+            if ( linger_time > 0 ) {
+                fprintf(stderr, "ABORT: Image is locked by another process or a lingering launch (see 'linger time')\n");
+            } else {
+                fprintf(stderr, "ABORT: Image is locked by another process\n");
+            }
             return(5);
         }
-        if ( mount_image(loop_dev, containerpath, 1) < 0 ) {
+        if ( loop_dev != NULL ) {
+            if ( mount_image(loop_dev, containerpath, 1, profile) < 0 ) {
+                fprintf(stderr, "ABORT: exiting...\n");
+                return(255);
+            }
+        } else if ( mount_dir(containerimage, containerpath, 1) < 0 ) {
             fprintf(stderr, "ABORT: exiting...\n");
             return(255);
         }
@@ -424,19 +851,70 @@ int main(int argc, char ** argv) {
         }
 
     } else {
-        if ( mount_bind(joinpath(tmpdir, "/tmp"), joinpath(containerpath, "/tmp"), 1) < 0 ) {
+        containdir = tmpdir;
+
+        // A tmpfs of its own for each launch, mounted in its namespace only.
+        // It goes away with the namespace, nothing is left to remove. The
+        // launch directory belongs to the user, so the mount point is a root
+        // owned one shared by all launches like the layer mount points.
+        if ( contain_tmpfs > 0 ) {
+            char options[128];
+
+            containdir = joinpath(LOCALSTATEDIR, "singularity/contain");
+            if ( s_mkpath(containdir, 0755) < 0 ) {
+                fprintf(stderr, "ABORT: Could not create directory %s: %s\n", containdir, strerror(errno));
+                return(255);
+            }
+
+            snprintf(options, sizeof(options), "mode=0750,uid=%d,gid=%d", uid, gid);
+            if ( contain_size > 0 ) {
+                snprintf(options + strlen(options), sizeof(options) - strlen(options), ",size=%dm", contain_size);
+            }
+            if ( mount("tmpfs", containdir, "tmpfs", MS_NOSUID|MS_NODEV, options) < 0 ) {
+                fprintf(stderr, "ABORT: Could not mount tmpfs on %s: %s\n", containdir, strerror(errno));
+                return(255);
+            }
+
+            if ( seteuid(uid) < 0 ) {
+                fprintf(stderr, "ABORT: Could not set effective user privledges to %d!\n", uid);
+                return(255);
+            }
+            if ( s_mkpath(joinpath(containdir, homepath), 0750) < 0 || s_mkpath(joinpath(containdir, "/tmp"), 0750) < 0 ) {
+                fprintf(stderr, "ABORT: Failed creating directories in %s: %s\n", containdir, strerror(errno));
+                return(255);
+            }
+            if ( seteuid(0) < 0 ) {
+                fprintf(stderr, "ABORT: Could not re-escalate effective user privledges!\n");
+                return(255);
+            }
+        }
+
+        if ( mount_bind(joinpath(containdir, "/tmp"), joinpath(containerpath, "/tmp"), 1) < 0 ) {
             fprintf(stderr, "ABORT: Could not bind tmp path to container %s: %s\n", "/tmp", strerror(errno));
             return(255);
         }
-        if ( mount_bind(joinpath(tmpdir, "/tmp"), joinpath(containerpath, "/var/tmp"), 1) < 0 ) {
+        if ( mount_bind(joinpath(containdir, "/tmp"), joinpath(containerpath, "/var/tmp"), 1) < 0 ) {
             fprintf(stderr, "ABORT: Could not bind tmp path to container %s: %s\n", "/var/tmp", strerror(errno));
             return(255);
         }
-        if ( mount_bind(joinpath(tmpdir, basehomepath), joinpath(containerpath, basehomepath), 1) < 0 ) {
+        if ( mount_bind(joinpath(containdir, basehomepath), joinpath(containerpath, basehomepath), 1) < 0 ) {
             fprintf(stderr, "ABORT: Could not bind tmp path to container %s: %s\n", basehomepath, strerror(errno));
             return(255);
         }
         strcpy(cwd, homepath);
+
+        // Only the binds into the container keep the tmpfs from here on
+        if ( contain_tmpfs > 0 && umount2(containdir, MNT_DETACH) < 0 ) {
+            fprintf(stderr, "WARNING: Could not unmount %s: %s\n", containdir, strerror(errno));
+        }
+    }
+
+    // Data images go last so they take precedence over the default binds
+    for ( i = 0; i < dataimage_count; i++ ) {
+        if ( mount_data_image(&dataimages[i], containerpath, profile) < 0 ) {
+            fprintf(stderr, "ABORT: exiting...\n");
+            return(255);
+        }
     }
 
 
@@ -450,6 +928,11 @@ int main(int argc, char ** argv) {
     if ( child_pid == 0 ) {
         char *prompt;
 
+        // Warming only sets up the launch, there is nothing to run
+        if ( warm_time > 0 ) {
+            return(0);
+        }
+
 
 //****************************************************************************//
 // Enter the file system                                                      //
@@ -498,7 +981,7 @@ int main(int argc, char ** argv) {
 //****************************************************************************//
 
         prompt = (char *) malloc(strlen(containername) + 16);
-        snprintf(prompt, strlen(containerimage) + 16, "Singularity/%s> ", containername);
+        snprintf(prompt, strlen(containername) + 16, "Singularity/%s> ", containername);
         setenv("PS1", prompt, 1);
 
         // After this, we exist only within the container... Let's make it known!
@@ -507,6 +990,20 @@ int main(int argc, char ** argv) {
             return(1);
         }
 
+        // Default environment from the image header, the caller's own
+        // settings win
+        if ( header_env != NULL ) {
+            char *line;
+
+            for ( line = strtok(header_env, "\n"); line != NULL; line = strtok(NULL, "\n") ) {
+                char *eq = strchr(line, '=');
+                if ( eq != NULL && eq != line ) {
+                    *eq = '\0';
+                    setenv(line, eq + 1, 0);
+                }
+            }
+        }
+
         if ( is_dir(cwd) == 0 ) {
             if ( chdir(cwd) < 0 ) {
                 fprintf(stderr, "ABORT: Could not chdir to: %s\n", cwd);
@@ -532,7 +1029,21 @@ int main(int argc, char ** argv) {
             }
 
         } else if ( strcmp(command, "run") == 0 ) {
-            if ( is_exec("/singularity") == 0 ) {
+            if ( header_runscript != NULL ) {
+                char **args = (char **) malloc(sizeof(char *) * (argc + 4));
+
+                args[0] = strdup("/bin/sh");
+                args[1] = strdup("-c");
+                args[2] = header_runscript;
+                args[3] = strdup(containername);
+                for ( i = 1; i <= argc; i++ ) {
+                    args[i + 3] = argv[i];
+                }
+
+                if ( execv("/bin/sh", args) != 0 ) {
+                    fprintf(stderr, "ABORT: exec of image header runscript failed: %s\n", strerror(errno));
+                }
+            } else if ( is_exec("/singularity") == 0 ) {
                 argv[0] = strdup("/singularity");
                 if ( execv("/singularity", argv) != 0 ) {
                     fprintf(stderr, "ABORT: exec of /bin/sh failed: %s\n", strerror(errno));
@@ -589,6 +1100,22 @@ int main(int argc, char ** argv) {
     }
 
 
+//****************************************************************************//
+// Warm up the image for the launches to come                                 //
+//****************************************************************************//
+
+    if ( warm_time > 0 && retval == 0 ) {
+        printf("Warmed %s (%s, %lld MB prefetched%s in %.2fs), keeping it ready for %d seconds\n", containername,
+                ( loop_dev != NULL ) ? loop_dev : "directory", prefetch_bytes / 1024 / 1024, ( hotlist_fd >= 0 ) ? " from hot list" : "",
+                prefetch_seconds, warm_time);
+        fflush(stdout);
+
+        if ( warm_time > linger_time ) {
+            linger_time = warm_time;
+        }
+    }
+
+
 //****************************************************************************//
 // Finall wrap up before exiting                                              //
 //****************************************************************************//
@@ -598,15 +1125,62 @@ int main(int argc, char ** argv) {
         retval++;
     }
 
+    // A lingering launch keeps its namespace, the contained tmpfs is let go
+    // of now
+    if ( containdir != NULL && contain_tmpfs > 0 ) {
+        umount2(joinpath(containerpath, "/tmp"), MNT_DETACH);
+        umount2(joinpath(containerpath, "/var/tmp"), MNT_DETACH);
+        umount2(joinpath(containerpath, basehomepath), MNT_DETACH);
+    }
+
+    // The last container out hands the launch to a lingering reaper, which
+    // runs the clean up below when its time is up. If the image is in use
+    // again by then, the reaper steps aside and the new last user lingers.
+    if ( linger_time > 0 && getenv("SINGULARITY_WRITABLE") == NULL && flock(tmpdirlock_fd, LOCK_EX | LOCK_NB) == 0 ) {
+        flock(tmpdirlock_fd, LOCK_SH);
+        if ( linger(linger_time, tmpdir) > 0 ) {
+            return(retval);
+        }
+    }
+
     if ( flock(tmpdirlock_fd, LOCK_EX | LOCK_NB) == 0 ) {
         close(tmpdirlock_fd);
         if ( s_rmdir(tmpdir) < 0 ) {
             fprintf(stderr, "WARNING: Could not remove all files in %s: %s\n", tmpdir, strerror(errno));
         }
+    } else if ( linger_time > 0 ) {
+        if ( utime(tmpdir, NULL) < 0 ) {
+            fprintf(stderr, "WARNING: Could not update %s: %s\n", tmpdir, strerror(errno));
+        }
     } else {
 //        printf("Not removing tmpdir, lock still\n");
     }
 
+    for ( i = 0; i < dataimage_count + layer_count; i++ ) {
+        struct extra_image *image = ( i < dataimage_count ) ? &dataimages[i] : &layers[i - dataimage_count];
+
+        if ( flock(image->tmpdirlock_fd, LOCK_EX | LOCK_NB) == 0 ) {
+            close(image->tmpdirlock_fd);
+            if ( s_rmdir(image->tmpdir) < 0 ) {
+                fprintf(stderr, "WARNING: Could not remove all files in %s: %s\n", image->tmpdir, strerror(errno));
+            }
+        }
+
+        // The last launch, on any host, from a version that has since been
+        // replaced by a newer publish removes it
+        if ( image->lock_fd >= 0 ) {
+            close(image->lock_fd);
+        }
+        image_version_release(image->path);
+        close(image->fd);
+    }
+
+    if ( containerlock_fd >= 0 ) {
+        close(containerlock_fd);
+    }
+    if ( is_dir(containerimage) != 0 ) {
+        image_version_release(containerimage);
+    }
     close(containerimage_fd);
     close(tmpdirlock_fd);
 
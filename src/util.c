@@ -27,6 +27,7 @@
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <errno.h> 
 #include <string.h>
 #include <fcntl.h>  
@@ -322,10 +323,36 @@ char *filecat(char *path) {
         ret[pos] = c;
         pos++;
     }
-    ret[length+1] = '\0';
+    ret[pos] = '\0';
 
     fclose(fd);
 
     return(ret);
 }
 
+int s_spawn(char *const argv[]) {
+    pid_t pid;
+    int status;
+
+    pid = fork();
+
+    if ( pid == 0 ) {
+        execvp(argv[0], argv);
+        fprintf(stderr, "ERROR: Could not exec %s: %s\n", argv[0], strerror(errno));
+        _exit(255);
+    } else if ( pid < 0 ) {
+        fprintf(stderr, "ERROR: Could not fork child process: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    if ( waitpid(pid, &status, 0) < 0 ) {
+        fprintf(stderr, "ERROR: Could not wait on %s: %s\n", argv[0], strerror(errno));
+        return(-1);
+    }
+
+    if ( WIFEXITED(status) ) {
+        return(WEXITSTATUS(status));
+    }
+
+    return(-1);
+}
@@ -36,3 +36,4 @@ char *strjoin(char *str1, char *str2);
 char *random_string(int length);
 char *filecat(char *path);
 int fileput(char *path, char *string);
+int s_spawn(char *const argv[]);
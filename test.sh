@@ -166,6 +166,309 @@ stest 1 singularity --quiet build example.sspec
 
 
 
+# Image tests
+stest 0 mkdir images
+stest 0 pushd images
+stest 0 singularity image -s 64 create test.img
+stest 1 singularity image expand test.img
+stest 0 singularity image -s 32 expand test.img
+stest 0 sh -c "test \`stat -c %s test.img\` -eq 100663296"
+stest 0 e2fsck -fn test.img
+stest 0 sudo env PATH="$PATH" singularity image compact test.img
+stest 0 e2fsck -fn test.img
+stest 0 sh -c "test \`stat -c %s test.img\` -eq 100663296"
+stest 0 sudo env PATH="$PATH" singularity image -S compact test.img
+stest 0 e2fsck -fn test.img
+stest 0 sh -c "test \`stat -c %s test.img\` -lt 100663296"
+
+# A minimal root file system from the host's shell, cat and ls
+stest 0 mkdir -p rootfs/etc rootfs/tmp rootfs/home rootfs/root rootfs/dev rootfs/proc rootfs/sys
+stest 0 sh -c "for i in /bin/sh /bin/cat /bin/ls /bin/true \`ldd /bin/sh /bin/cat /bin/ls /bin/true | grep -o '/[^ ]*'\`; do cp --parents -L \$i rootfs/; done"
+stest 0 sh -c "/bin/echo 'root:x:0:0:root:/root:/bin/sh' > rootfs/etc/passwd"
+stest 0 sh -c "/bin/echo 'root:x:0:' > rootfs/etc/group"
+stest 0 sh -c "/bin/echo 'hello123' > rootfs/etc/hello"
+stest 0 tar -C rootfs -cf rootfs.tar .
+stest 0 sudo env PATH="$PATH" singularity image import import.img rootfs.tar
+stest 0 e2fsck -fn import.img
+stest 0 sh -c "cat rootfs.tar | sudo env PATH=\"$PATH\" singularity image import stream.img -"
+stest 0 sh -c "test \`stat -c %s stream.img\` -lt 1073741824"
+stest 0 sh -c "gzip -c rootfs.tar > rootfs.tar.gz"
+stest 0 sudo env PATH="$PATH" singularity image import gzip.img rootfs.tar.gz
+stest 0 sh -c "test \`stat -c %s gzip.img\` -lt 1073741824"
+stest 0 touch "rootfs/tmp/a long name holding a pax size=99999999999 record that ustar can not store"
+stest 0 tar -C rootfs --format=pax -cf pax.tar .
+stest 0 sudo env PATH="$PATH" singularity image import pax.img pax.tar
+stest 0 sh -c "test \`stat -c %s pax.img\` -lt 1073741824"
+stest 0 rm "rootfs/tmp/a long name holding a pax size=99999999999 record that ustar can not store"
+
+stest 0 cp import.img signed.img
+stest 0 singularity image sign signed.img
+stest 0 singularity image verify signed.img
+stest 0 sh -c "singularity exec signed.img /bin/cat /etc/hello | grep -q 'hello123'"
+stest 0 singularity exec signed.img /bin/true
+stest 0 sh -c "/bin/echo corrupt | dd of=signed.img bs=1 seek=4096 conv=notrunc"
+stest 1 singularity image verify signed.img
+stest 1 singularity exec signed.img /bin/true
+stest 0 singularity image sign signed.img
+stest 0 singularity exec signed.img /bin/true
+
+stest 0 cp import.img changed.img
+stest 0 sh -c "/bin/echo changed | dd of=changed.img bs=1 seek=8192 conv=notrunc"
+stest 0 singularity image diff import.img changed.img changed.delta
+stest 0 sh -c "test \`stat -c %s changed.delta\` -lt \`stat -c %s changed.img\`"
+stest 0 singularity image patch import.img changed.delta patched.img
+stest 0 cmp changed.img patched.img
+stest 1 singularity image patch signed.img changed.delta patched2.img
+
+SINGULARITY_STORE="$TEMPDIR/images/store"
+export SINGULARITY_STORE
+stest 0 singularity image store add import.img base
+stest 0 singularity image store add changed.img changed
+stest 0 singularity image store list
+stest 0 singularity image store get changed fromstore.img
+stest 0 cmp changed.img fromstore.img
+stest 0 sh -c "cmp import.img \`singularity image store path base\`"
+stest 0 singularity image store add changed.img base
+stest 0 sh -c "cmp changed.img \`singularity image store path base\`"
+stest 0 singularity image store rm changed
+stest 0 singularity image store gc
+stest 1 singularity image store get changed fromstore.img
+unset SINGULARITY_STORE
+
+stest 0 mkdir data
+stest 0 sh -c "/bin/echo 'data123' > data/data.txt"
+stest 0 tar -C data -cf data.tar .
+stest 0 sudo env PATH="$PATH" singularity image import data.img data.tar
+stest 0 sh -c "singularity exec -D data.img:/root import.img /bin/cat /root/data.txt | grep -q 'data123'"
+stest 0 sh -c "singularity exec -D data.img:/root -D data.img:/tmp import.img /bin/cat /tmp/data.txt | grep -q 'data123'"
+stest 1 singularity exec -D data.img:/nonexistent import.img /bin/true
+stest 1 singularity exec -D data.img import.img /bin/true
+
+stest 0 mkdir -p layer/etc
+stest 0 sh -c "/bin/echo 'layer123' > layer/etc/layer"
+stest 0 tar -C layer -cf layer.tar .
+stest 0 sudo env PATH="$PATH" singularity image import layer.img layer.tar
+stest 0 sh -c "singularity exec -L layer.img import.img /bin/cat /etc/layer | grep -q 'layer123'"
+stest 0 sh -c "singularity exec -L layer.img import.img /bin/cat /etc/hello | grep -q 'hello123'"
+stest 1 singularity exec -w -L layer.img import.img /bin/true
+
+stest 0 sudo cp -a rootfs rootdir
+stest 0 sudo chown -R root:root rootdir
+stest 0 sh -c "singularity exec rootdir /bin/cat /etc/hello | grep -q 'hello123'"
+stest 0 sudo mkdir rootdir/mnt
+stest 0 sudo mount -t tmpfs tmpfs rootdir/mnt
+stest 0 sudo touch rootdir/mnt/submount
+stest 1 sh -c "singularity exec rootdir /bin/ls /mnt | grep -q submount"
+stest 0 sudo umount rootdir/mnt
+stest 0 sudo cp -a rootfs userdir
+stest 0 sudo chown -R 1:1 userdir
+stest 1 singularity exec userdir /bin/true
+
+stest 0 sh -c "/bin/echo '#!/bin/sh' > runscript"
+stest 0 sh -c "/bin/echo '/bin/cat /etc/hello' >> runscript"
+stest 0 sh -c "/bin/echo 'WRAPPED=yes' > env"
+stest 0 singularity image -r runscript -e env wrap import.img wrapped.img
+stest 0 sh -c "singularity image info wrapped.img | grep -q 'FS offset'"
+stest 0 sh -c "singularity run wrapped.img | grep -q 'hello123'"
+stest 0 sh -c "singularity exec wrapped.img /bin/cat /proc/self/environ | grep -aq 'WRAPPED=yes'"
+stest 0 cp wrapped.img corrupt.img
+stest 0 sh -c "printf '\\377\\377\\377\\377\\377\\377\\377\\377' | dd of=corrupt.img bs=1 seek=280 conv=notrunc"
+stest 1 singularity image info corrupt.img
+
+stest 0 sh -c "singularity image ls import.img /etc | grep -q 'hello'"
+stest 0 sh -c "singularity image ls wrapped.img | grep -q 'etc'"
+stest 1 singularity image ls import.img /nonexistent
+stest 0 sh -c "singularity image cat import.img /etc/hello | grep -q 'hello123'"
+stest 0 sh -c "singularity image cat wrapped.img /etc/hello | grep -q 'hello123'"
+stest 1 singularity image cat import.img /nonexistent
+stest 1 singularity image cat import.img /etc
+stest 1 singularity image cat import.img '/etc/hello" "/etc/passwd'
+stest 0 singularity image cp-out import.img /etc/hello hello.out
+stest 0 cmp rootfs/etc/hello hello.out
+stest 0 mkdir out
+stest 0 singularity image cp-out import.img /etc out
+stest 0 cmp rootfs/etc/hello out/etc/hello
+stest 1 singularity image cp-out import.img /nonexistent out
+
+stest 0 singularity image clone import.img clone.img
+stest 0 cmp import.img clone.img
+stest 0 sh -c "stat -c %A clone.img | grep -q w"
+stest 1 singularity image clone import.img clone.img
+stest 0 singularity image snapshot import.img snap.img
+stest 0 cmp import.img snap.img
+stest 1 sh -c "stat -c %A snap.img | grep -q w"
+
+stest 0 singularity image publish import.img app
+stest 0 sh -c "singularity exec app /bin/cat /etc/hello | grep -q 'hello123'"
+stest 0 mkfifo hold
+stest 0 sh -c "singularity exec app /bin/cat < hold > /dev/null & exec 3> hold; sleep 2; singularity image publish clone.img app; test -f app.versions/1.img; R=\$?; exec 3>&-; wait; exit \$R"
+stest 1 test -f app.versions/1.img
+stest 0 sh -c "singularity exec app /bin/cat /etc/hello | grep -q 'hello123'"
+stest 0 singularity image publish import.img app
+stest 1 test -f app.versions/2.img
+stest 1 test -f app.versions/2.img.lock
+stest 0 test -f app.versions/3.img
+stest 0 test -f app.versions/3.img.lock
+stest 0 sh -c "flock -s app.versions/3.img.lock sleep 3 & sleep 1; singularity image publish clone.img app; singularity exec app.versions/3.img /bin/true; test -f app.versions/3.img; R=\$?; wait; exit \$R"
+stest 0 singularity exec app.versions/3.img /bin/true
+stest 1 test -f app.versions/3.img
+stest 1 test -f app.versions/3.img.lock
+
+SINGULARITY_CONF="$TEMPDIR/etc/singularity/singularity.conf"
+stest 0 sudo sed -i -e 's/^linger time = .*/linger time = 3/' "$SINGULARITY_CONF"
+stest 0 singularity exec clone.img /bin/true
+stest 0 sh -c "losetup -j clone.img | grep -q loop"
+stest 0 singularity exec clone.img /bin/true
+stest 1 singularity exec -w clone.img /bin/true
+stest 0 sleep 5
+stest 1 sh -c "losetup -j clone.img | grep -q loop"
+stest 0 singularity exec -w clone.img /bin/true
+stest 0 sudo sed -i -e 's/^linger time = .*/linger time = 0/' "$SINGULARITY_CONF"
+stest 0 singularity warm -t 3 clone.img
+stest 0 sh -c "losetup -j clone.img | grep -q loop"
+stest 0 singularity exec clone.img /bin/true
+stest 1 singularity exec -w clone.img /bin/true
+stest 0 sleep 5
+stest 1 sh -c "losetup -j clone.img | grep -q loop"
+stest 0 singularity warm -p clone.img -t 1
+stest 0 sleep 3
+stest 0 singularity warm -r clone.img
+stest 0 test -s clone.img.hot
+stest 0 sudo sed -i -e 's/^warm time = .*/warm time = 0/' "$SINGULARITY_CONF"
+stest 1 singularity warm clone.img
+stest 0 sudo sed -i -e 's/^warm time = .*/warm time = 600/' "$SINGULARITY_CONF"
+
+# Bootstrap from the minimal root file system, no distribution needed
+stest 0 sh -c "for i in rootfs/*; do /bin/echo \"InstallFile $TEMPDIR/images/\$i /\${i#rootfs/}\"; done > boot.def"
+stest 0 sh -c "/bin/echo 'RunCmd \"echo step1 > /step1\"' >> boot.def"
+stest 0 sh -c "/bin/echo 'RunCmd \"echo step2 > /step2\"' >> boot.def"
+stest 0 singularity image -s 64 create boot.img
+stest 0 sudo env PATH="$PATH" singularity bootstrap boot.img boot.def
+stest 0 sh -c "singularity exec boot.img /bin/cat /step2 | grep -q 'step2'"
+stest 0 singularity image -s 64 create cached.img
+stest 0 sudo env PATH="$PATH" SINGULARITY_CACHEDIR="$SINGULARITY_CACHEDIR" singularity bootstrap -c cached.img boot.def
+stest 0 sh -c "/bin/echo 'RunCmd \"echo step3 > /step3\"' >> boot.def"
+stest 0 singularity image -s 64 create cached.img
+stest 0 sh -c "sudo env PATH=\"$PATH\" SINGULARITY_CACHEDIR=\"$SINGULARITY_CACHEDIR\" singularity bootstrap -c cached.img boot.def 2>&1 | grep -q 'Restoring build root from cache'"
+stest 0 sh -c "singularity exec cached.img /bin/cat /step1 /step3 | grep -q 'step3'"
+stest 0 sudo rm -rf "$SINGULARITY_CACHEDIR/bootstrap"
+stest 0 cp boot.def cacheexcl.def
+stest 0 sh -c "/bin/echo 'PkgCacheBind smoke /var/cache/smoke || mkdir -p \$SINGULARITY_BUILD_ROOT/var/cache/smoke' >> cacheexcl.def"
+stest 0 sh -c "/bin/echo 'RunCmd \"echo pkg > /var/cache/smoke/pkg\"' >> cacheexcl.def"
+stest 0 mkdir cacheexcldir
+stest 0 sudo env PATH="$PATH" SINGULARITY_CACHEDIR="$SINGULARITY_CACHEDIR" singularity bootstrap -c -s "$TEMPDIR/images/cacheexcldir" cacheexcl.img cacheexcl.def
+stest 0 test -f "$SINGULARITY_CACHEDIR/packages/smoke/pkg"
+stest 1 sh -c "for i in $SINGULARITY_CACHEDIR/bootstrap/*.tar; do tar -tf \$i; done | grep -q 'var/cache/smoke/pkg'"
+stest 0 sudo rm -rf "$SINGULARITY_CACHEDIR/bootstrap" "$SINGULARITY_CACHEDIR/packages"
+
+stest 0 cp rootfs/bin/true captrue
+stest 0 sudo setcap cap_net_raw+ep captrue
+stest 0 cp boot.def xattr.def
+stest 0 sh -c "/bin/echo 'InstallFile $TEMPDIR/images/captrue /captrue' >> xattr.def"
+stest 0 sudo env PATH="$PATH" SINGULARITY_CACHEDIR="$SINGULARITY_CACHEDIR" singularity bootstrap -c -s tmpfs xattr.img xattr.def
+stest 0 sh -c "/bin/echo 'RunCmd \"echo step4 > /step4\"' >> xattr.def"
+stest 0 sh -c "sudo env PATH=\"$PATH\" SINGULARITY_CACHEDIR=\"$SINGULARITY_CACHEDIR\" singularity bootstrap -c -s tmpfs xattr.img xattr.def 2>&1 | grep -q 'Restoring build root from cache'"
+stest 0 sh -c "debugfs -R 'ea_list /captrue' xattr.img 2>/dev/null | grep -q 'security.capability'"
+stest 0 sudo rm -rf "$SINGULARITY_CACHEDIR/bootstrap"
+
+stest 0 cp boot.def pkgcache.def
+stest 0 sh -c "/bin/echo 'PkgCacheBind smoke /var/cache/smoke || mkdir -p \$SINGULARITY_BUILD_ROOT/var/cache/smoke' >> pkgcache.def"
+stest 0 sh -c "/bin/echo 'RunCmd \"echo pkg > /var/cache/smoke/pkg\"' >> pkgcache.def"
+stest 0 singularity image -s 64 create pkgcache.img
+stest 0 sudo env PATH="$PATH" SINGULARITY_CACHEDIR="$SINGULARITY_CACHEDIR" singularity bootstrap pkgcache.img pkgcache.def
+stest 0 test -f "$SINGULARITY_CACHEDIR/packages/smoke/pkg"
+stest 1 singularity exec pkgcache.img /bin/cat /var/cache/smoke/pkg
+stest 1 sh -c "grep -q ' $TEMPDIR/' /proc/mounts"
+stest 0 sudo rm -rf "$SINGULARITY_CACHEDIR/packages"
+stest 0 singularity image -s 64 create pkgcache.img
+stest 0 sudo env PATH="$PATH" SINGULARITY_CACHEDIR="$SINGULARITY_CACHEDIR" singularity bootstrap -n pkgcache.img pkgcache.def
+stest 1 test -d "$SINGULARITY_CACHEDIR/packages/smoke"
+stest 0 sh -c "singularity exec pkgcache.img /bin/cat /var/cache/smoke/pkg | grep -q 'pkg'"
+
+stest 0 sudo env PATH="$PATH" singularity bootstrap -s tmpfs scratch.img boot.def
+stest 0 sh -c "singularity exec scratch.img /bin/cat /step3 | grep -q 'step3'"
+stest 0 sh -c "test \`stat -c %s scratch.img\` -lt \`stat -c %s boot.img\`"
+stest 0 mkdir scratchdir
+stest 0 sudo env PATH="$PATH" singularity bootstrap -s "$TEMPDIR/images/scratchdir" scratch2.img boot.def
+stest 0 sh -c "singularity exec scratch2.img /bin/cat /step3 | grep -q 'step3'"
+stest 1 sh -c "ls scratchdir/* 2>/dev/null"
+
+stest 0 cp boot.def parse.def
+stest 0 sh -c "printf '%s\n' ': <<\"EOF\"' 'Name: parsed \\' 'value' '%runscript' 'echo hello' '  %Runscript' 'echo other' 'EOF' >> parse.def"
+stest 0 sh -c "/bin/echo 'get_key_from_conf NAME \"\$BUILD_SPEC\" > \"\$SINGULARITY_BUILD_ROOT/defkey\"' >> parse.def"
+stest 0 sh -c "/bin/echo 'get_section_from_conf runscript \"\$BUILD_SPEC\" > \"\$SINGULARITY_BUILD_ROOT/defsection\"' >> parse.def"
+stest 0 singularity image -s 64 create parse.img
+stest 0 sudo env PATH="$PATH" singularity bootstrap parse.img parse.def
+stest 0 sh -c "singularity exec parse.img /bin/cat /defkey | grep -qx 'parsed value'"
+stest 0 sh -c "singularity exec parse.img /bin/cat /defsection | grep -qx 'echo hello'"
+stest 1 sh -c "singularity exec parse.img /bin/cat /defsection | grep -q 'other'"
+
+stest 0 cp boot.def batch.def
+stest 0 sh -c "printf '%s\n' \"RunCmd 'echo \\\"\\\$0:\\\$1\\\" > /args' 'a b' c\" >> batch.def"
+stest 0 sh -c "printf '%s\n' \"RunCmd 'echo \\\"\\\$0:\\\$1\\\" > /args2' 'd e' f\" >> batch.def"
+stest 0 singularity image -s 64 create batch.img
+stest 0 sudo env PATH="$PATH" singularity bootstrap batch.img batch.def
+stest 0 sh -c "singularity exec batch.img /bin/cat /args | grep -qx 'a b:c'"
+stest 0 singularity image -s 64 create batch.img
+stest 0 sudo env PATH="$PATH" singularity bootstrap -b batch.img batch.def
+stest 0 sh -c "singularity exec batch.img /bin/cat /step3 | grep -q 'step3'"
+stest 0 sh -c "singularity exec batch.img /bin/cat /args | grep -qx 'a b:c'"
+stest 0 sh -c "singularity exec batch.img /bin/cat /args2 | grep -qx 'd e:f'"
+
+stest 0 singularity image -s 64 create profile.img
+stest 0 sh -c "sudo env PATH=\"$PATH\" singularity bootstrap -p \"$TEMPDIR/images/trace.tsv\" profile.img boot.def > profile.out"
+stest 0 sh -c "tail -n 1 profile.out | grep -q 'bootstrap:definition'"
+stest 0 sh -c "grep -c 'bootstrap:definition' profile.out | grep -qx 1"
+stest 0 grep -q '^# step' trace.tsv
+stest 0 sh -c "grep '^RunCmd' trace.tsv | grep -q 'step3'"
+stest 0 grep -q '^bootstrap:definition' trace.tsv
+
+stest 0 cp boot.def dedupe.def
+stest 0 sh -c "/bin/echo 'RunCmd \"echo same > /dup1; echo same > /dup2; echo same > /etc/dup1; echo same > /etc/dup2\"' >> dedupe.def"
+stest 0 singularity image -s 64 create dedupe.img
+stest 1 sudo env PATH="$PATH" singularity bootstrap -o bogus dedupe.img dedupe.def
+stest 0 sudo env PATH="$PATH" singularity bootstrap -o dedupe dedupe.img dedupe.def
+stest 0 sh -c "singularity exec dedupe.img /bin/ls -l /dup2 | grep -q '^-[^ ]* 2 '"
+stest 0 sh -c "singularity exec dedupe.img /bin/ls -l /etc/dup2 | grep -q '^-[^ ]* 1 '"
+
+stest 0 sudo env PATH="$PATH" singularity bootstrap -r repro1.img boot.def
+stest 0 sleep 1
+stest 0 sudo env PATH="$PATH" singularity bootstrap -r repro2.img boot.def
+stest 0 cmp repro1.img repro2.img
+stest 0 sh -c "singularity exec repro1.img /bin/cat /step3 | grep -q 'step3'"
+stest 0 sudo env PATH="$PATH" SOURCE_DATE_EPOCH=1 singularity bootstrap -r repro2.img boot.def
+stest 1 cmp -s repro1.img repro2.img
+
+stest 0 sh -c "singularity exec profile.img /bin/cat /proc/mounts | grep -q '^[^ ]* / .*norecovery'"
+stest 1 sh -c "sudo env PATH=\"$PATH\" singularity exec -w profile.img /bin/cat /proc/mounts | grep -q '^[^ ]* / .*norecovery'"
+stest 0 sudo sed -i -e 's/^mount profile exec = .*/mount profile exec = default/' "$SINGULARITY_CONF"
+stest 1 sh -c "singularity exec profile.img /bin/cat /proc/mounts | grep -q '^[^ ]* / .*norecovery'"
+stest 0 sudo sed -i -e 's/^mount profile exec = .*/mount profile exec = bogus/' "$SINGULARITY_CONF"
+stest 0 sh -c "singularity exec profile.img /bin/true 2>&1 | grep -q 'Unknown mount profile'"
+stest 0 sudo sed -i -e 's/^mount profile exec = .*/mount profile exec = launch/' "$SINGULARITY_CONF"
+
+stest 0 cp boot.def contain.def
+stest 0 sh -c "/bin/echo 'mkdir -p \"\$SINGULARITY_BUILD_ROOT/var/tmp\"' >> contain.def"
+stest 0 singularity image -s 64 create contain.img
+stest 0 sudo env PATH="$PATH" singularity bootstrap contain.img contain.def
+stest 0 sh -c "singularity exec -C contain.img /bin/ls -A /tmp > contained.out"
+stest 1 test -s contained.out
+stest 1 sh -c "singularity exec -C contain.img /bin/cat /proc/mounts | grep -q ' /tmp tmpfs '"
+stest 0 sudo sed -i -e 's/^contain tmpfs = .*/contain tmpfs = yes/' "$SINGULARITY_CONF"
+stest 0 sh -c "singularity exec -C contain.img /bin/cat /proc/mounts | grep -q ' /tmp tmpfs '"
+stest 0 sh -c "singularity exec -C contain.img /bin/ls -A /tmp > contained.out"
+stest 1 test -s contained.out
+stest 1 sh -c "ls -d /tmp/.singularity-*/contain 2>/dev/null"
+stest 0 sudo sed -i -e 's/^contain tmpfs size = .*/contain tmpfs size = 8/' "$SINGULARITY_CONF"
+stest 0 sh -c "singularity exec -C contain.img /bin/cat /proc/mounts | grep -q ' /tmp tmpfs .*size=8192k'"
+stest 0 sudo sed -i -e 's/^contain tmpfs size = .*/contain tmpfs size = 0/' "$SINGULARITY_CONF"
+stest 0 sudo sed -i -e 's/^contain tmpfs = .*/contain tmpfs = no/' "$SINGULARITY_CONF"
+
+stest 0 popd
+stest 0 sudo rm -rf images
+
+
+
 # Cleaning up
 stest 0 singularity delete cat
 stest 0 singularity delete ls